@@ -0,0 +1,11 @@
+#ifndef __CACHE_H
+#define __CACHE_H
+#include "shmake.h"
+
+bool cache_open(str_t dir, int64_t max_size);
+bool cache_is_open();
+bool cache_fetch(Target *T);
+void cache_store(Target *T);
+void cache_close(bool report);
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef __CRITICAL_H
+#define __CRITICAL_H
+#include "shmake.h"
+
+void critical_path_report(Target *T, bool print, str_t graph);
+
+#endif
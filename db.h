@@ -0,0 +1,64 @@
+#ifndef __DB_H
+#define __DB_H
+#include <llib/str.h>
+
+// what we remember about a file's contents
+typedef struct DbFile_ {
+    str_t name;
+    int64_t mtime, size;
+    uint64_t digest;
+    str_t *includes; // its #include lines, like '"foo.h' or '<bar.h', if it has been scanned
+} DbFile;
+
+// what we remember about a target from the last time it was built
+typedef struct DbTarget_ {
+    str_t name;
+    uint64_t inputs; // digest of all the prerequisites' digests
+    int64_t stamp; // time of the output after it was built (ns)
+    str_t command; // the command which built it
+    str_t *deps; // what it was found to depend on (from .d files)
+    uint64_t signature; // digest of the command
+    // what the command cost the last time it ran (see JobUsage)
+    int64_t user, sys, maxrss, nvcsw, nivcsw;
+    int64_t changed; // when its contents last changed (ns), if a command has since made it again the same
+} DbTarget;
+
+// what a shmakefile wrote the last time it was run, and what that depended on
+typedef struct DbScript_ {
+    str_t name;
+    uint64_t key; // digest of the shmakefile, its environment and /tmp/shmake.sh
+    str_t *watch; // directories which may have been globbed, and included scripts,
+    int64_t *times; // with their times (ns)
+    uint64_t *listings; // and for directories, a digest of the names in them
+    char *output; // the commands (array_len is the size)
+} DbScript;
+
+// how a need was resolved, and a digest of what that answer depends on
+typedef struct DbNeed_ {
+    str_t name; // the .need file, or 'pkg-config NAME'
+    uint64_t key;
+    str_t cflags, lflags;
+    str_t search_path; // pkg-config's built-in search path (only in the 'pkg-config' record)
+} DbNeed;
+
+bool db_open(str_t path);
+void db_close();
+bool db_is_open();
+
+DbFile *db_file(str_t name);
+DbFile *db_file_new(str_t name);
+void db_file_save(DbFile *f);
+
+DbTarget *db_target(str_t name);
+DbTarget *db_target_new(str_t name);
+void db_target_save(DbTarget *t);
+
+DbScript *db_script(str_t name);
+DbScript *db_script_new(str_t name);
+void db_script_save(DbScript *s);
+
+DbNeed *db_need(str_t name);
+DbNeed *db_need_new(str_t name);
+void db_need_save(DbNeed *n);
+
+#endif
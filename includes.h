@@ -0,0 +1,7 @@
+#ifndef __INCLUDES_H
+#define __INCLUDES_H
+#include "shmake.h"
+
+str_t *include_scan(str_t file, str_t *incdirs);
+
+#endif
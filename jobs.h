@@ -0,0 +1,42 @@
+#ifndef __JOBS_H
+#define __JOBS_H
+#include <llib/str.h>
+
+bool jobs_client();
+void jobs_set_max(int n);
+int jobs_max();
+int jobs_running();
+bool jobs_free();
+void jobs_release();
+bool jobs_fewer();
+int jobs_limit();
+void jobs_memory_aware(bool on);
+bool jobs_memory_free(int64_t need);
+bool jobs_set_memory_max(int64_t bytes);
+bool jobs_use_worker(str_t path);
+bool jobs_worker();
+
+// what a finished job cost, from wait4()
+typedef struct JobUsage_ {
+    int64_t user, sys; // CPU time (microseconds)
+    int64_t maxrss; // peak resident memory (KiB)
+    int64_t nvcsw, nivcsw; // voluntary and involuntary context switches
+    bool oom; // the kernel killed a process for lack of memory while it ran (not for job-memory-max)
+} JobUsage;
+
+// what a job wrote to stdout or stderr (NUL-terminated)
+typedef struct JobText_ {
+    char *data;
+    int len, cap;
+} JobText;
+
+// a file a job reads, and the digest of its contents
+typedef struct JobInput_ {
+    str_t path;
+    uint64_t digest;
+} JobInput;
+
+int job_start(str_t cmd, void *data, int64_t memory, JobInput *inputs);
+void *job_wait(int *status, JobUsage *usage, JobText *output, bool want_slot);
+
+#endif
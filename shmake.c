@@ -14,7 +14,10 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/utsname.h>
 #include <errno.h>
+#include <ctype.h>
+#include <fnmatch.h>
 #include <unistd.h>
 #include <llib/str.h>
 #include <llib/array.h>
@@ -25,22 +28,51 @@
 
 #include "shmake.h"
 #include "utils.h"
+#include "jobs.h"
+#include "db.h"
+#include "cache.h"
+#include "watch.h"
+#include "trace.h"
+#include "critical.h"
+#include "worker.h"
 
-#define MAX_LINE_BUFSZ 4096
+#define SHMAKE_DB ".shmake_db"
 
 static ArgState *arg_state;
 static bool testing;
+static bool evaluate;
+static bool startup_stats;
 static  int verbose_level;
 static str_t private_need_path;
 
 
 #define quit(msg,...) arg_quit(arg_state,str_fmt(msg,__VA_ARGS__),false)
 
-static void exec(str_t cmd) {
-    int res = system(cmd);
-    if (res != 0) {
-        quit("executing '%s' failed",cmd);
+// '--startup-stats': the steps before building starts, which on a build with nothing
+// to do is nearly all the time. The same steps go into the trace.
+static str_t **s_startup;
+static int s_processes;
+static int64_t s_main_start;
+
+static void startup_phase(str_t name, int64_t start) {
+    trace_phase(name,start);
+    if (startup_stats) {
+        if (! s_startup) {
+            s_startup = seq_new_ref(str_t);
+        }
+        seq_add(s_startup,str_fmt("%8.2fms  %s",(trace_now() - start)/1000.0,name));
+    }
+}
+
+static void startup_report() {
+    str_t *lines = seq_array_ref(s_startup);
+    printf("shmake: %.2fms before building, %d process%s started\n",(clock_us() - s_main_start)/1000.0,
+        s_processes,s_processes == 1 ? "" : "es");
+    FOR(i,array_len(lines)) {
+        printf("%s\n",lines[i]);
     }
+    unref(lines);
+    s_startup = NULL;
 }
 
 //////// Providing NEEDS ///////
@@ -74,57 +106,335 @@ str_t lookup_and_subst(char **cfg, str_t key) {
     return res;
 }
 
-// first, see if NEED.need exists in current dir or in ~/.shmake
-// If so, then it is a property-style file that needs at least one of
-// 'cflags' or 'libs' defined.
-// If not, then we ask pkg-config
-Need *need_from_name(str_t name) {
-    Need *N = obj_new(Need,NULL);
-    N->name = str_ref(name);
-    if (need_check_builtin(N)) {
-        return N;
+// the full path of a program on the PATH, or NULL
+static str_t path_find(str_t name) {
+    str_t path = getenv("PATH");
+    char **dirs = str_split(path ? path : "/usr/bin:/bin",":");
+    str_t found = NULL;
+    for (char **d = dirs; *d && ! found; d++) {
+        str_t file = str_fmt("%s/%s",*d,name);
+        FileStat *st = file_stat(file);
+        if (st->exists && ! st->is_dir) {
+            found = file;
+        } else {
+            unref(file);
+        }
     }
-    str_t  nfile = str_fmt("./%s.need",name);
-    if (! file_exists(nfile,"r") && private_need_path) {
-        nfile = str_fmt("%s/%s.need",private_need_path,name);
+    unref(dirs);
+    return found;
+}
+
+// is there a program of this name on the PATH?
+static bool on_path(str_t name) {
+    str_t file = path_find(name);
+    unref(file);
+    return file != NULL;
+}
+
+// Resolving a need means running a script or pkg-config, which is slow enough to
+// notice when there are a few of them. So each need is resolved once per run, and
+// the answer is kept in the build database, with a digest of what it depends on:
+// the .need file's time and size, or the .pc file which pkg-config will find, and
+// pkg-config's environment. All the needs a shmakefile mentions are looked up
+// before making any targets, and the ones we don't know are resolved together.
+
+// needs resolved in this run, keyed by where they come from (see need_source)
+static StrHash *s_needs;
+static Need s_unresolved; // so we complain about a need only once
+static str_t *s_pc_dirs;
+
+// NAME.need in the current dir, the need-path or ~/.shmake; otherwise 'pkg-config NAME'.
+static str_t need_source(str_t name, str_t need_path) {
+    str_t nfile = str_fmt("./%s.need",name);
+    if (! file_exists(nfile,"r") && need_path) {
+        nfile = str_fmt("%s/%s.need",need_path,name);
     }
     if (! file_exists(nfile,"r")) {
         nfile = str_fmt("%s/.shmake/%s.need",getenv("HOME"),name);
     }
     if (file_exists(nfile,"r")) {
-        if (! file_exists(nfile,"rx")) {
-            fprintf(stderr,"'%s': not executable\n",nfile);
-            return NULL;
+        return nfile;
+    }
+    return str_fmt("pkg-config %s",name);
+}
+
+static bool need_is_pkg(str_t source) {
+    return str_starts_with(source,"pkg-config ");
+}
+
+static void dirs_add(str_t **dirs, str_t path) {
+    if (path && *path) {
+        seq_adda(dirs,str_split(path,":"),-1);
+    }
+}
+
+// where pkg-config looks for .pc files. Its built-in path is also remembered,
+// for as long as pkg-config itself does not change.
+static str_t *pc_dirs() {
+    if (s_pc_dirs) {
+        return s_pc_dirs;
+    }
+    str_t **dirs = seq_new_ref(str_t);
+    dirs_add(dirs,getenv("PKG_CONFIG_PATH"));
+    if (getenv("PKG_CONFIG_LIBDIR")) {
+        dirs_add(dirs,getenv("PKG_CONFIG_LIBDIR"));
+    } else {
+        str_t prog = path_find("pkg-config");
+        if (prog) {
+            FileStat *st = file_stat(prog);
+            uint64_t key = hash_str(prog,st->mtime ^ st->size);
+            DbNeed *rec = db_need("pkg-config");
+            if (! rec || rec->key != key || ! rec->search_path || evaluate) {
+                rec = db_need_new("pkg-config");
+                unref(rec->search_path);
+                rec->search_path = file_command("pkg-config --variable pc_path pkg-config");
+                ++s_processes;
+                rec->key = key;
+                db_need_save(rec);
+            }
+            dirs_add(dirs,rec->search_path);
         }
-        N->cflags = NULL;
-        N->lflags = NULL;
-        // The need script is passed its dirname
-        str_t here = file_dirname(nfile);
-        str_t cmd = str_fmt("%s '%s'",nfile,here);
-        char **lines = file_command_lines(cmd);
-        FOR(i,array_len(lines)) {
-            char **parts = str_split_n(lines[i]," ",1);
-            if (str_eq(parts[0],"cflags")) {
-                N->cflags = parts[1];
-            } else
-            if (str_eq(parts[0],"libs")) {
-                N->lflags = parts[1];
+    }
+    s_pc_dirs = seq_array_ref(dirs);
+    return s_pc_dirs;
+}
+
+static str_t pkg_env[] = {"PKG_CONFIG_PATH","PKG_CONFIG_LIBDIR","PKG_CONFIG_SYSROOT_DIR",NULL};
+
+// the .pc file which pkg-config would find for a package, or NULL
+static str_t pc_file(str_t name) {
+    str_t *dirs = pc_dirs();
+    FOR(i,array_len(dirs)) {
+        str_t pc = str_fmt("%s/%s.pc",dirs[i],name);
+        if (file_stat(pc)->exists) {
+            return pc;
+        }
+        unref(pc);
+    }
+    return NULL;
+}
+
+// the packages named in a .pc file's Requires and Requires.private lines,
+// like 'glib-2.0 >= 2.50, libffi'
+static void pc_requires(str_t pc, str_t **names) {
+    str_t text = file_read_all(pc,true);
+    if (! text)
+        return;
+    char **lines = str_split(text,"\n");
+    for (char **L = lines; *L; L++) {
+        char *p = *L;
+        if (! (str_starts_with(p,"Requires:") || str_starts_with(p,"Requires.private:")))
+            continue;
+        char **words = str_split(strchr(p,':') + 1," \t,");
+        bool version = false;
+        for (char **w = words; *w; w++) {
+            if (strchr("<>=!",**w)) { // an operator, and then its version
+                version = true;
+                continue;
             }
+            if (! version) {
+                seq_add(names,str_fmt("%.*s",(int)strcspn(*w,"<>=!"),*w));
+            }
+            version = false;
         }
-        if (! N->cflags && ! N->lflags) {
-            fprintf(stderr,"'%s': at least one of cflags and libs must be echoed out\n",nfile);
-            return NULL;
+        unref(words);
+    }
+    dispose(lines,text);
+}
+
+// a digest of what the need's answer depends on, or zero if we can't tell.
+// For pkg-config that is the package's .pc file and those of all the packages
+// it requires, however indirectly.
+static uint64_t need_key(str_t name, str_t source) {
+    uint64_t key = 0;
+    if (need_is_pkg(source)) {
+        str_t **names = seq_new_ref(str_t);
+        StrHash *seen = strhash_new(16);
+        seq_add(names,str_new(name));
+        for (int i = 0; i < array_len(*names); i++) {
+            str_t pkg = (*names)[i];
+            if (strhash_get(seen,pkg))
+                continue;
+            strhash_put(seen,pkg,(void*)pkg);
+            str_t pc = pc_file(pkg);
+            if (! pc) {
+                if (i == 0) {
+                    dispose(names,seen);
+                    return 0;
+                }
+                // pkg-config will complain about it
+                key = hash_str(pkg,key);
+                continue;
+            }
+            FileStat *st = file_stat(pc);
+            key = hash_str(pc,key ^ st->mtime ^ st->size);
+            pc_requires(pc,names);
+            unref(pc);
         }
+        dispose(names,seen);
+    } else {
+        FileStat *st = file_stat(source);
+        key = hash_str(source,st->mtime ^ st->size);
+    }
+    for (str_t *v = pkg_env; *v; v++) {
+        str_t value = getenv(*v);
+        key = hash_str(value ? value : "",key);
+    }
+    return key ? key : 1;
+}
 
-        return N;
+static Need *need_new(str_t name, str_t cflags, str_t lflags) {
+    Need *N = obj_new(Need,NULL);
+    N->name = str_ref(name);
+    N->cflags = cflags;
+    N->lflags = lflags;
+    return N;
+}
+
+// pkg-config gives us all the flags at once, so we sort them out. Only
+// the linker wants -l, -L, -Wl and libraries, and only the compiler wants -I
+// and -D; anything else, like -pthread or -fopenmp, goes to both.
+static Need *need_from_pkg_config(str_t name, str_t *lines) {
+    char **cs = strbuf_new();
+    char **ls = strbuf_new();
+    FOR(i,array_len(lines)) {
+        char **flags = str_split(lines[i]," ");
+        for (char **f = flags; *f; f++) {
+            bool lib = str_starts_with(*f,"-l") || str_starts_with(*f,"-L") || str_starts_with(*f,"-Wl,")
+                || str_ends_with(*f,".a") || str_ends_with(*f,".so");
+            bool comp = str_starts_with(*f,"-I") || str_starts_with(*f,"-D") || str_starts_with(*f,"-U");
+            if (str_eq(*f,"-framework") && f[1]) { // macOS: goes with the next word
+                strbuf_addf(ls," %s %s",f[0],f[1]);
+                ++f;
+                continue;
+            }
+            if (! lib) {
+                strbuf_addsp(cs,*f);
+            }
+            if (! comp) {
+                strbuf_addsp(ls,*f);
+            }
+        }
+        unref(flags);
+    }
+    str_t cflags = strbuf_tostring(cs), lflags = strbuf_tostring(ls);
+    if (! (*cflags || *lflags)) {
+        return NULL;
+    }
+    return need_new(name,cflags,lflags);
+}
+
+// A .need script must echo at least one of 'cflags ...' and 'libs ...'
+static Need *need_from_script(str_t name, str_t nfile, str_t *lines) {
+    Need *N = need_new(name,NULL,NULL);
+    FOR(i,array_len(lines)) {
+        char **parts = str_split_n(lines[i]," ",1);
+        if (str_eq(parts[0],"cflags")) {
+            N->cflags = parts[1];
+        } else
+        if (str_eq(parts[0],"libs")) {
+            N->lflags = parts[1];
+        }
     }
-    N->cflags = file_command_fmt("pkg-config --cflags %s",name);
-    N->lflags = file_command_fmt("pkg-config --libs %s",name);
-    if (! (*N->cflags || *N->lflags))
+    if (! N->cflags && ! N->lflags) {
+        fprintf(stderr,"'%s': at least one of cflags and libs must be echoed out\n",nfile);
         return NULL;
+    }
     return N;
 }
 
+typedef struct NeedRun_ {
+    str_t name, source;
+    uint64_t key;
+    FILE *out;
+} NeedRun;
+
+// make sure we know about these needs. Those which are not already known
+// have their scripts (or pkg-config) started together, and then we collect the answers.
+static void needs_resolve(str_t *names, str_t need_path) {
+    if (! s_needs) {
+        s_needs = strhash_new(32);
+    }
+    int n = array_len(names), nrun = 0;
+    NeedRun *runs = array_new(NeedRun,n);
+    FOR(i,n) {
+        str_t name = names[i];
+        Need *N = need_new(name,NULL,NULL);
+        if (need_check_builtin(N)) {
+            continue;
+        }
+        str_t source = need_source(name,need_path);
+        if (strhash_get(s_needs,source)) {
+            continue;
+        }
+        uint64_t key = need_key(name,source);
+        DbNeed *rec = db_need(source);
+        if (rec && key && rec->key == key && ! evaluate) {
+            strhash_put(s_needs,source,need_new(name,rec->cflags,rec->lflags));
+            continue;
+        }
+        str_t cmd;
+        if (need_is_pkg(source)) {
+            cmd = str_fmt("pkg-config --cflags --libs %s",name);
+        } else {
+            if (! file_exists(source,"rx")) {
+                fprintf(stderr,"'%s': not executable\n",source);
+                strhash_put(s_needs,source,&s_unresolved);
+                continue;
+            }
+            // The need script is passed its dirname
+            cmd = str_fmt("%s '%s'",source,file_dirname(source));
+        }
+        FILE *out = popen(cmd,"r");
+        ++s_processes;
+        if (! out) {
+            perror(cmd);
+            strhash_put(s_needs,source,&s_unresolved);
+            continue;
+        }
+        NeedRun *R = &runs[nrun++];
+        R->name = name;
+        R->source = source;
+        R->key = key;
+        R->out = out;
+    }
+    FOR(i,nrun) {
+        NeedRun *R = &runs[i];
+        str_t *lines = (str_t*)file_getlines(R->out);
+        int res = pclose(R->out);
+        Need *N = NULL;
+        if (need_is_pkg(R->source)) {
+            N = res == 0 ? need_from_pkg_config(R->name,lines) : NULL;
+        } else {
+            N = need_from_script(R->name,R->source,lines);
+        }
+        strhash_put(s_needs,R->source,N ? N : &s_unresolved);
+        if (N) {
+            if (R->key && ! testing) {
+                DbNeed *rec = db_need_new(R->source);
+                rec->key = R->key;
+                rec->cflags = str_new(N->cflags ? N->cflags : "");
+                rec->lflags = str_new(N->lflags ? N->lflags : "");
+                db_need_save(rec);
+            }
+        }
+    }
+    unref(runs);
+}
+
+// first, see if NEED.need exists in current dir, in the need-path or in ~/.shmake.
+// If so, then it is a script which echoes at least one of 'cflags' or 'libs'.
+// If not, then we ask pkg-config
+Need *need_from_name(str_t name) {
+    Need *N = need_new(name,NULL,NULL);
+    if (need_check_builtin(N)) {
+        return N;
+    }
+    needs_resolve(VAS(name),private_need_path);
+    N = (Need*)strhash_get(s_needs,need_source(name,private_need_path));
+    return N == &s_unresolved ? NULL : N;
+}
+
 void need_update(str_t *need_list, str_t *cflags, str_t *lflags) {
     char **cs = strbuf_new();
     char **ls = strbuf_new();
@@ -152,6 +462,9 @@ typedef struct Args_ {
     str_t needs;
     str_t out_extension;
     str_t output_directory;
+    str_t pch;
+    int unity;
+    str_t separate;
     str_t* files;
 } Args;
 
@@ -172,6 +485,24 @@ static bool macosx;
 static bool debug;
 static bool quiet;
 static bool slack;
+static int jobs;
+static str_t s_jobs;
+static bool hashing;
+static str_t diagnostics;
+static str_t s_cache;
+static str_t s_cache_size = "5G";
+static str_t s_job_memory_max;
+static bool watch;
+static str_t s_linker_flag;
+static bool s_thin_archives, s_split_dwarf;
+static str_t trace_file;
+static bool critical_path;
+static str_t graph_file;
+static bool usage_stats;
+static str_t worker_socket;
+// what we need to start again when watching
+static const char **s_argv;
+static str_t s_start_dir, s_makeflags;
 
 void * main_args[] = {
     "// shmake: a simple shell-based make tool",
@@ -182,8 +513,18 @@ void * main_args[] = {
     "bool slack; // -S disable strict warnings", &slack,
     "bool verbose[]; // -v verbose output",&verbose,
     "bool quiet; // -q no output unless error",&quiet,
+    "int jobs=0; // -j number of commands to run at once (default 1, or S jobs)",&jobs,
     "string create=''; // -c create shmakefile from statement",&do_create,
+    "string diagnostics=''; // -d diagnostics to print at the end: 'stats' for file system calls",&diagnostics,
     "string expr=''; // -e simple throwaway shmake expression",&shmake_exp,
+    "bool evaluate; // -E always run the shmakefile and resolve needs, even if nothing they depend on has changed",&evaluate,
+    "bool watch; // -w keep watching the sources, and build again when they change",&watch,
+    "string trace=''; // -T write a Chrome trace of the build to this file",&trace_file,
+    "bool startup-stats; // show where the time went before building, and what processes were started",&startup_stats,
+    "bool critical-path; // -K show the longest chain of actions, and the slack of the others",&critical_path,
+    "string graph=''; // -G write the targets as a Graphviz file, with the critical path marked",&graph_file,
+    "bool stats; // show what the commands cost in time and memory, largest first",&usage_stats,
+    "string worker=''; // run commands for other shmakes on this socket (they set SHMAKE_WORKER to it)",&worker_socket,
     "string #1[]; // target and VAR=VALUE assignments",&shmake_args,
     NULL
 };
@@ -202,6 +543,9 @@ void * compiler_args[] = {
     "string exclude=''; // -x exclude files from list",&s_args.exclude,
     "string rule=''; // -R specify out extension for rule",&s_args.out_extension,
     "string output=''; // -d output directory",&s_args.output_directory,
+    "string pch=''; // -P header to precompile and include in every file",&s_args.pch,
+    "int unity=0; // -U compile files in unity chunks of about this many",&s_args.unity,
+    "string separate=''; // -s files to compile on their own in a unity build",&s_args.separate,
     "string #1=''; // name of program",&s_args.name,
     "string #2[]; // source files",&s_args.files,
     NULL
@@ -246,7 +590,22 @@ static void process_rule(ArgState *rule_state, str_t *args) {
         targets[i] = target(tname,VAS(files[i]),s_rule_args.command);
     }
     Group *G = group_new(s_rule_args.command,targets);
-    G->name =s_rule_args.name;
+    group_set_name(G,s_rule_args.name);
+}
+
+// 'S linker' asks the compiler to use another linker, if it can be found.
+static str_t linker_flag(str_t name) {
+    if (str_eq(name,"default")) {
+        return NULL;
+    }
+    if (! str_eq_any(name,"mold","lld","gold")) {
+        quit("linker is one of 'mold', 'lld', 'gold' or 'default', not %s",name);
+    }
+    if (! on_path(str_fmt("ld.%s",name)) && ! (str_eq(name,"mold") && on_path("mold"))) {
+        fprintf(stderr,"shmake: linker '%s' not found, using the default\n",name);
+        return NULL;
+    }
+    return str_fmt("-fuse-ld=%s",name);
 }
 
 //~ // implementing the  S command.  Note that all values except opt , exports and debug may
@@ -279,6 +638,9 @@ void set_defaults(str_t name, str_t value) {
     if (str_eq(name,"out-dir")) {
         s_def.output_directory = value;
     } else
+    if (str_eq(name,"pch")) {
+        s_def.pch = value;
+    } else
     if (str_eq(name,"debug")) {
         s_def.debug = str2bool(value);
     } else
@@ -293,6 +655,45 @@ void set_defaults(str_t name, str_t value) {
     } else
     if (str_eq(name,"slack")) {
         slack = str2bool(value);
+    } else
+    if (str_eq(name,"jobs")) {
+        s_jobs = value;
+    } else
+    if (str_eq(name,"change-detection")) {
+        if (! str_eq_any(value,"hash","time")) {
+            quit("change-detection is either 'time' or 'hash', not %s",value);
+        }
+        hashing = str_eq(value,"hash");
+    } else
+    if (str_eq(name,"keep-dfiles")) {
+        shmake_keep_dfiles(str2bool(value));
+    } else
+    if (str_eq(name,"cache")) {
+        s_cache = value;
+    } else
+    if (str_eq(name,"cache-size")) {
+        s_cache_size = value;
+    } else
+    if (str_eq(name,"memory")) {
+        jobs_memory_aware(str2bool(value));
+    } else
+    if (str_eq(name,"job-memory-max")) {
+        s_job_memory_max = value;
+    } else
+    if (str_eq(name,"linker")) {
+        s_linker_flag = linker_flag(value);
+    } else
+    if (str_eq(name,"thin-archives")) {
+        s_thin_archives = str2bool(value);
+    } else
+    if (str_eq(name,"split-dwarf")) {
+        s_split_dwarf = str2bool(value);
+    } else
+    if (str_eq(name,"restat")) {
+        if (! str_eq_any(value,"true","false","headers")) {
+            quit("restat is 'true', 'false' or 'headers', not %s",value);
+        }
+        shmake_restat(str_eq(value,"true") ? RESTAT_ALL : str_eq(value,"false") ? RESTAT_NONE : RESTAT_HEADERS);
     } else {
         quit("unknown default variable name %s",name);
     }
@@ -306,7 +707,9 @@ void update_needs() {
     }
     str_t *need_list = split(s_args.needs);
     if (need_list) {
+        int64_t start = trace_now();
         need_update(need_list, &s_args.cflags, &s_args.lflags);
+        startup_phase(str_fmt("needs %s",s_args.needs),start);
     }
 }
 
@@ -323,6 +726,10 @@ Group *compile_from_args(str_t compiler, str_t *files) {
     // strictly speaking, these are not mutually exclusive.
     if (s_args.debug) {
         cat (cflags,"-g");
+        // the debug info stays in .dwo files, so the linker has much less to do
+        if (s_split_dwarf) {
+            cat (cflags,"-gsplit-dwarf");
+        }
         debug = true;
     } else {
         cat (cflags,str_fmt("-O%s",s_args.opt));
@@ -344,7 +751,9 @@ Group *compile_from_args(str_t compiler, str_t *files) {
     if (str_eq(odir,"auto")) {
         odir = str_fmt("%s-%s",compiler,debug ? "debug" : "release");
     }
-    return compile_step(compiler,files, s_args.cflags, includes_list, defines_list,odir);
+    str_t pch = *s_args.pch ? s_args.pch : s_def.pch;
+    return compile_step(compiler,files, s_args.cflags, includes_list, defines_list,odir,pch,
+        s_args.unity,split(s_args.separate));
 }
 
 Target *link_from_args(str_t compiler, str_t name, str_t *objs, int kind) {
@@ -369,6 +778,19 @@ Target *link_from_args(str_t compiler, str_t name, str_t *objs, int kind) {
         }
     }
 
+    if (kind == LINK_LIB) {
+        if (s_thin_archives) {
+            kind = LINK_THIN_LIB;
+        }
+    } else
+    if (s_linker_flag) {
+        cat (&s_args.lflags,s_linker_flag);
+        // the default linker cannot make an index of split debug info
+        if (s_split_dwarf && s_args.debug) {
+            cat (&s_args.lflags,"-Wl,--gdb-index");
+        }
+    }
+
     if (! s_args.lflags) {
         s_args.lflags = "";
     }
@@ -467,40 +889,41 @@ Target  *straight_build(str_t compiler, str_t name, str_t *files) {
        if (! G) {
            quit("no source files for group: %s",name);
        }
-       G->name = name;
+       group_set_name(G,name);
        return NULL;
     }
 }
 
+// the first of these programs which is on the PATH (or the last, if none are)
+static str_t first_on_path(str_t gnu, str_t other) {
+    return on_path(gnu) || ! on_path(other) ? gnu : other;
+}
+
 void setup_compiler(str_t name) {
     if (str_eq(name,"c")) {
         if (CC) return;
         CC = getenv("CC");
         if (! CC)
-            CC = file_command("basename $(which gcc || which cc)");
+            CC = first_on_path("gcc","cc");
     } else
     if (str_eq(name,"c++")) {
         if (CXX) return;
         CXX = getenv("CXX");
         if  (! CXX)
-            CXX = file_command("basename $(which g++ || which c++)");
+            CXX = first_on_path("g++","c++");
     }
 }
 
 // a shmake file needs to source /tmp/shmake.sh, which is generated
-// from this string if it doesn't exist. The arguments to the shell functions
-// are carefully separated by colons and written to the temporary file
-// which we'll consume afterwards.
-
+// from this string. The shell functions write their arguments to the
+// temporary file which we'll consume afterwards.
+// Each command is written as a record: the number of words, then the words,
+// each terminated by a NUL. printf is a builtin, so no processes are forked,
+// and words may contain anything except NUL.
 static str_t shmake_sh =
 "out=$1\n"
 "pipe() {\n"
-"   res=''\n"
-"   for f in \"$@\"; do\n"
-"       f=$(printf '%%s' \"$f\" | tr '\\n' '\\001')\n"
-"       res=\"$res:$f\"\n"
-"   done\n"
-"   echo $res >> $out\n"
+"   printf '%%s\\0' $# \"$@\" >> \"$out\"\n"
 "}\n"
 "dir_exists() {\n"
  "local name=$1;  shift 1\n"
@@ -516,45 +939,607 @@ static str_t shmake_sh =
 "S() { pipe set \"$@\"; }\n"
 "R() { pipe rule \"$@\"; }\n"
 "Q() { pipe quit \"$@\"; }\n"
-"all() { pipe all \"$@\"; }\n";
+"all() { pipe all \"$@\"; }\n"
+"restat() { pipe restat \"$@\"; }\n";
+
+// the next NUL-terminated word written by the shmakefile
+static char *next_word(char **pp, char *end) {
+    char *word = *pp;
+    if (word >= end) {
+        quit("truncated output from '%s'",shmakefile);
+    }
+    *pp = word + strlen(word) + 1;
+    return word;
+}
+
+// sizes like 500M or 5G
+static int64_t parse_size(str_t s) {
+    char *end;
+    int64_t size = strtoll(s,&end,10);
+    switch (*end) {
+    case 'G': case 'g': size *= 1024;
+    case 'M': case 'm': size *= 1024;
+    case 'K': case 'k': size *= 1024;
+    }
+    return size;
+}
+
+// 'S cache true' uses $SHMAKE_CACHE, or ~/.cache/shmake; otherwise it is the directory.
+static void cache_setup() {
+    if (! s_cache || str_eq(s_cache,"false"))
+        return;
+    str_t dir = s_cache;
+    if (str_eq(dir,"true")) {
+        dir = getenv("SHMAKE_CACHE");
+        if (! dir) {
+            str_t home = getenv("HOME");
+            dir = str_fmt("%s/.cache/shmake",home ? home : "/tmp");
+        }
+    }
+    cache_open(dir,parse_size(s_cache_size));
+}
+
+//////// Remembering what the shmakefile wrote ///////
+
+// Running the shmakefile is often the slowest part of a no-op build, so what it wrote
+// is kept in the build database. It is used again if the shmakefile, the environment
+// and the directory are the same, and nothing has changed in the directories where
+// its files live (which is where any globs would have been expanded). Scripts
+// sourced with '.' are also watched.
+
+extern char **environ;
+
+// these change from run to run without affecting what the shmakefile does
+static str_t volatile_env[] = {"MAKEFLAGS","MFLAGS","MAKELEVEL","SHLVL","OLDPWD","_",NULL};
+
+static bool env_is_volatile(str_t var) {
+    for (str_t *v = volatile_env; *v; v++) {
+        int len = strlen(*v);
+        if (strncmp(var,*v,len) == 0 && var[len] == '=')
+            return true;
+    }
+    return false;
+}
+
+static uint64_t script_key(str_t text) {
+    char cwd[4096];
+    uint64_t h = hash_str(text,0);
+    h = hash_str(shmake_sh,h);
+    if (getcwd(cwd,sizeof(cwd))) {
+        h = hash_str(cwd,h);
+    }
+    // the order of the environment does not matter
+    uint64_t env = 0;
+    for (char **e = environ; *e; e++) {
+        if (! env_is_volatile(*e)) {
+            env += hash_str(*e,0);
+        }
+    }
+    return hash_bytes(&env,sizeof(env),h);
+}
+
+// what editors leave around while a file is being edited: hidden files like
+// '.foo.c.swp', backups like 'foo.c~' and '#foo.c#', and vim's '4913'
+static bool editor_file(str_t path) {
+    str_t name = file_basename(path);
+    int len = strlen(name);
+    if (len == 0)
+        return false;
+    return *name == '.' || name[len-1] == '~' || (len > 4 && str_eq(name+len-4,".swp"))
+        || (*name == '#' && len > 1 && name[len-1] == '#') || str_eq(name,"4913");
+}
+
+// the files shmake builds (and editors' files) come and go without affecting the shmakefile's globs
+static bool skip_output(str_t path) {
+    if (str_starts_with(file_basename(path),SHMAKE_DB) || editor_file(path))
+        return true;
+    if (db_target(path) || target_from_file(path))
+        return true;
+    if (str_ends_with(path,".d")) { // from an object or a precompiled header
+        str_t obj = file_replace_extension(path,".o");
+        str_t gch = str_fmt("%.*s.gch",(int)strlen(path) - 2,path);
+        return db_target(obj) || target_from_file(obj) || db_target(gch) || target_from_file(gch);
+    }
+    return false;
+}
+
+// time of a file or directory in nanoseconds, zero if it does not exist
+static int64_t watch_time(str_t path, bool *is_dir) {
+    struct stat st;
+    if (stat(path,&st) != 0)
+        return 0;
+    *is_dir = S_ISDIR(st.st_mode);
+    return st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec;
+}
+
+static str_t parent_dir(str_t path) {
+    char *dir = file_dirname(path);
+    int len = strlen(dir);
+    if (len > 1 && dir[len-1] == '/') {
+        dir[len-1] = '\0';
+    }
+    return *dir ? dir : ".";
+}
+
+static void watch_add(StrHash *seen, str_t **watch, str_t path) {
+    if (! strhash_get(seen,path)) {
+        path = str_new(path);
+        strhash_put(seen,path,(void*)path);
+        seq_add(watch,path);
+    }
+}
+
+// scripts sourced by the shmakefile, and by them in turn
+static void watch_includes(StrHash *seen, str_t **watch, str_t text) {
+    char **lines = str_split(text,"\n");
+    for (char **L = lines; *L; L++) {
+        char *p = *L;
+        while (*p == ' ' || *p == '\t')
+            ++p;
+        if (! (str_starts_with(p,". ") || str_starts_with(p,"source ")))
+            continue;
+        p = strchr(p,' ');
+        while (*p == ' ')
+            ++p;
+        int len = strcspn(p," \t;&|");
+        char *file = str_new_size(len);
+        strncpy(file,p,len);
+        if (strpbrk(file,"$`") || str_eq(file,"/tmp/shmake.sh") || strhash_get(seen,file))
+            continue;
+        str_t contents = file_read_all(file,true);
+        if (contents) {
+            watch_add(seen,watch,file);
+            watch_includes(seen,watch,contents);
+        }
+    }
+    unref(lines);
+}
+
+// is this one of the shmake.sh functions which just write a record, like C or T?
+static bool record_function(str_t name) {
+    int len = strlen(name);
+    for (str_t p = strstr(shmake_sh,"\n"); p; p = strchr(p + 1,'\n')) {
+        if (strncmp(p + 1,name,len) == 0 && str_starts_with(p + 1 + len,"() { pipe "))
+            return true;
+    }
+    return false;
+}
+
+static bool is_assignment(str_t word) {
+    if (! (isalpha(*word) || *word == '_'))
+        return false;
+    while (isalnum(*word) || *word == '_')
+        ++word;
+    return *word == '=';
+}
+
+// the end of the shell word at p, or NULL if it runs a command ($(...) or `...`)
+// or a quote is not closed
+static str_t word_end(str_t p) {
+    while (*p && ! strchr(" \t\n;&|<>(){}",*p)) {
+        if (*p == '`' || (*p == '$' && p[1] == '('))
+            return NULL;
+        if (*p == '\\' && p[1]) {
+            p += 2;
+        } else
+        if (*p == '\'') {
+            p = strchr(p + 1,'\'');
+            if (! p)
+                return NULL;
+            ++p;
+        } else
+        if (*p == '"') {
+            for (++p; *p != '"'; ++p) {
+                if (! *p || *p == '`' || (*p == '$' && p[1] == '('))
+                    return NULL;
+                if (*p == '\\' && p[1])
+                    ++p;
+            }
+            ++p;
+        } else
+        if (*p == '$' && p[1] == '{') {
+            p = strchr(p,'}');
+            if (! p)
+                return NULL;
+            ++p;
+        } else {
+            ++p;
+        }
+    }
+    return p;
+}
+
+// Can we reuse what the shmakefile wrote last time? Only if all it does is call the
+// functions which write records, set variables and source scripts which are as plain.
+// Anything else - 'shmake -C', if, pipes, redirection, $(...) - may do something
+// besides writing records, or depend on something we do not watch, so it must run.
+static bool script_is_plain(str_t text, StrHash *seen) {
+    str_t p = text;
+    for (;;) {
+        p += strspn(p," \t\n;");
+        if (! *p)
+            return true;
+        if (*p == '#') {
+            p = strchr(p,'\n');
+            if (! p)
+                return true;
+            continue;
+        }
+        // a simple command: its name and then its arguments
+        str_t file = NULL;
+        int nwords = 0;
+        bool source = false, assign = false;
+        for (;;) {
+            p += strspn(p," \t");
+            if (*p == '\\' && p[1] == '\n') {
+                p += 2;
+                continue;
+            }
+            if (! *p || *p == '\n' || *p == ';' || *p == '#')
+                break;
+            str_t end = word_end(p);
+            if (! end || end == p)
+                return false;
+            str_t word = str_fmt("%.*s",(int)(end - p),p);
+            bool ok = true;
+            if (nwords == 0) {
+                source = str_eq(word,".") || str_eq(word,"source");
+                assign = is_assignment(word);
+                ok = source || assign || record_function(word);
+            } else {
+                ok = ! assign; // VAR=VALUE command
+            }
+            if (source && nwords == 1) {
+                file = word;
+            } else {
+                unref(word);
+            }
+            if (! ok)
+                return false;
+            ++nwords;
+            p = end;
+        }
+        if (source) {
+            if (! file || strpbrk(file,"$\"'\\")) {
+                unref(file);
+                return false;
+            }
+            if (str_eq(file,"/tmp/shmake.sh") || strhash_get(seen,file)) {
+                unref(file);
+                continue;
+            }
+            strhash_put(seen,file,(void*)file);
+            str_t contents = file_read_all(file,true);
+            bool plain = contents && script_is_plain(contents,seen);
+            unref(contents);
+            if (! plain)
+                return false;
+        }
+    }
+}
+
+// what the shmakefile wrote last time, if nothing it depends on has changed
+static char *script_output(uint64_t key) {
+    DbScript *s = db_script(shmakefile);
+    if (! s || s->key != key)
+        return NULL;
+    FOR(i,array_len(s->watch)) {
+        bool is_dir = false;
+        int64_t t = watch_time(s->watch[i],&is_dir);
+        if (t == s->times[i])
+            continue;
+        // a directory changes whenever shmake builds something in it
+        uint64_t listing;
+        if (! is_dir || ! dir_digest(s->watch[i],skip_output,&listing) || listing != s->listings[i])
+            return NULL;
+    }
+    return s->output;
+}
+
+// after a successful build, remember what the shmakefile wrote and what it depends on
+static void script_save(str_t text, uint64_t key, char *output) {
+    StrHash *seen = strhash_new(64);
+    str_t **ws = seq_new_ref(str_t);
+    watch_add(seen,ws,parent_dir(shmakefile));
+    watch_includes(seen,ws,text);
+    char *end = output + array_len(output);
+    for (char *p = output; p < end; p += strlen(p) + 1) {
+        if (*p == '\0' || *p == '-' || strchr(p,' ') || ! file_stat(p)->exists)
+            continue;
+        str_t dir = parent_dir(p);
+        watch_add(seen,ws,dir);
+        while (*dir != '/' && ! str_eq(dir,".")) {
+            dir = parent_dir(dir);
+            watch_add(seen,ws,dir);
+        }
+    }
+    str_t *watch = seq_array_ref(ws);
+    int n = array_len(watch);
+    int64_t *times = array_new(int64_t,n);
+    uint64_t *listings = array_new(uint64_t,n);
+    DbScript *s = db_script_new(shmakefile);
+    bool changed = s->key != key || s->output != output || array_len(s->watch) != n;
+    FOR(i,n) {
+        bool is_dir = false;
+        times[i] = watch_time(watch[i],&is_dir);
+        listings[i] = 0;
+        if (! changed && str_eq(watch[i],s->watch[i]) && times[i] == s->times[i]) {
+            listings[i] = s->listings[i];
+        } else {
+            changed = true;
+            if (is_dir) {
+                dir_digest(watch[i],skip_output,&listings[i]);
+            }
+        }
+    }
+    if (changed) {
+        if (s->output != output) {
+            unref(s->output);
+            s->output = ref(output);
+        }
+        dispose(s->watch,s->times,s->listings);
+        s->key = key;
+        s->watch = watch;
+        s->times = times;
+        s->listings = listings;
+        db_script_save(s);
+    } else {
+        dispose(watch,times,listings);
+    }
+    unref(seen);
+}
+
+// start again from the top, as if we had just been run
+static void restart(str_t why) {
+    if (! quiet) {
+        printf("shmake: %s, starting again\n",why);
+    }
+    fflush(stdout);
+    cache_close(false);
+    db_close();
+    trace_suspend();
+    if (s_makeflags) {
+        setenv("MAKEFLAGS",s_makeflags,true);
+    } else {
+        unsetenv("MAKEFLAGS");
+    }
+    if (chdir(s_start_dir) == 0) {
+        execvp(s_argv[0],(char**)s_argv);
+    }
+    perror("shmake: restart");
+    exit(1);
+}
+
+static void build_report(Target *T) {
+    if (critical_path || *graph_file) {
+        critical_path_report(T,critical_path,graph_file);
+    }
+    if (usage_stats) {
+        targets_usage_report(20);
+    }
+}
+
+// The glob patterns in the shmakefile and the scripts it sources, like '*.c' or
+// '$SRC/*.c' (a variable may be anything). Only a file which one of these could
+// match can change what the shmakefile says - unless it runs commands, which
+// could look at anything.
+static str_t *s_globs;
+static bool s_any_file;
+
+static void script_globs(str_t text, str_t **globs) {
+    if (strchr(text,'`') || strstr(text,"$(")) {
+        s_any_file = true;
+    }
+    char **words = str_split(text," \t\n;|&()");
+    for (char **w = words; *w; w++) {
+        if (! strpbrk(*w,"*?["))
+            continue;
+        char **pat = strbuf_new();
+        for (str_t p = *w; *p; p++) {
+            if (*p == '"' || *p == '\'')
+                continue;
+            if (*p == '$') { // $NAME or ${NAME}
+                strbuf_add(pat,'*');
+                if (p[1] == '{') {
+                    p = strchr(p,'}') ? strchr(p,'}') : p + strlen(p) - 1;
+                } else {
+                    while (isalnum(p[1]) || p[1] == '_')
+                        ++p;
+                }
+                continue;
+            }
+            strbuf_add(pat,*p);
+        }
+        seq_add(globs,strbuf_tostring(pat));
+    }
+    unref(words);
+}
+
+// a file has come or gone: could that change what the shmakefile says?
+static bool not_globbed(str_t path) {
+    if (skip_output(path))
+        return true;
+    if (s_any_file)
+        return false;
+    if (str_starts_with(path,"./"))
+        path += 2;
+    FOR(i,array_len(s_globs)) {
+        if (fnmatch(s_globs[i],path,0) == 0)
+            return false;
+    }
+    return true;
+}
+
+// With -w we build, wait for some of the files to change, and build again,
+// keeping the targets and what we know about files in memory. If the shmakefile
+// (or a script it sources) changes, or files come and go where it found its
+// sources, then it must be run again and we start from the top.
+static void watch_and_build(Target *T, str_t text, uint64_t key) {
+    StrHash *seen = strhash_new(16);
+    str_t **ws = seq_new_ref(str_t);
+    watch_add(seen,ws,shmakefile);
+    watch_includes(seen,ws,text);
+    str_t *scripts = seq_array_ref(ws);
+    str_t **globs = seq_new_ref(str_t);
+    script_globs(text,globs);
+    FOR(i,array_len(scripts)) {
+        str_t contents = str_eq(scripts[i],shmakefile) ? NULL : file_read_all(scripts[i],true);
+        if (contents) {
+            script_globs(contents,globs);
+            unref(contents);
+        }
+    }
+    s_globs = seq_array_ref(globs);
+    watch_open();
+    for (;;) {
+        str_t **files = seq_new_ref(str_t);
+        seq_adda(files,target_sources(),-1);
+        seq_adda(files,scripts,-1);
+        str_t *paths = seq_array_ref(files);
+        watch_files(paths);
+        if (! quiet) {
+            printf("shmake: watching %d files\n",array_len(paths));
+            fflush(stdout);
+        }
+        unref(paths);
+        bool new_files;
+        str_t *changed = watch_wait(not_globbed,&new_files);
+        if (! changed) {
+            break;
+        }
+        FOR(i,array_len(changed)) {
+            if (strhash_get(seen,changed[i])) {
+                restart(str_fmt("'%s' has changed",changed[i]));
+            }
+        }
+        if (new_files && ! script_output(key)) {
+            restart("files have been added or removed");
+        }
+        if (array_len(changed) > 0) {
+            targets_reset(changed);
+            int64_t start = trace_now();
+            target_check(T);
+            trace_phase("build",start);
+            build_report(T);
+        }
+        unref(changed);
+    }
+    dispose(scripts,seen);
+}
+
+// find all the needs in the shmakefile's output, so that they can be resolved together.
+// Needs given by 'S needs' or -n are plain names; 'S need-path' changes where they're found.
+static void needs_prefetch(char *p, char *end) {
+    str_t **names = seq_new_ref(str_t);
+    str_t need_path = NULL;
+    while (p < end) {
+        int n = atoi(next_word(&p,end));
+        if (n < 1) {
+            break;
+        }
+        char *cmd = next_word(&p,end);
+        bool set = str_eq(cmd,"set");
+        str_t prev = NULL;
+        FOR(i,n-1) {
+            char *arg = next_word(&p,end);
+            if (set && i > 0 && str_eq(prev,"needs")) {
+                seq_adda(names,split(arg),-1);
+            } else
+            if (set && i == 1 && str_eq(prev,"need-path")) {
+                str_t *batch = seq_array_ref(names);
+                needs_resolve(batch,need_path);
+                unref(batch);
+                names = seq_new_ref(str_t);
+                need_path = arg;
+            } else
+            if (*cmd == 'C' && prev && str_eq_any(prev,"-n","--needs")) {
+                seq_adda(names,split(arg),-1);
+            } else
+            if (*cmd == 'C' && str_starts_with(arg,"--needs=")) {
+                seq_adda(names,split(arg + strlen("--needs=")),-1);
+            }
+            if (! set || i == 0) {
+                prev = arg;
+            }
+        }
+    }
+    str_t *all = seq_array_ref(names);
+    needs_resolve(all,need_path);
+    unref(all);
+}
 
 int run_shmakefile(str_t specific_target) {
-    char buff[MAX_LINE_BUFSZ];
     if (! file_exists(shmakefile,"r")) {  // "x"!!!
         quit("'%s' does not exist",shmakefile);
     }
-    // for now, ALWAYS overwrite shmake.sh. Makes upgrading
-    // easier, doubt if it's a performance problem!
-    //if (! file_exists("/tmp/shmake.sh","r")) {
-        file_write_fmt("/tmp/shmake.sh",shmake_sh);
-    //}
+    // the build database is needed to find what objects depend on
+    int64_t start = trace_now();
+    db_open(SHMAKE_DB);
+    startup_phase("load build database",start);
     ArgState *state = arg_parse_spec(compiler_args);
     ArgState *rule_state = arg_parse_spec(rule_args);
-    str_t tmp_file = str_fmt("/tmp/shmake.%d",getpid());
     str_t *args = NULL;
-    int n = system(str_fmt("%s%s %s",(*shmakefile=='/' ? "" : "./"),shmakefile,tmp_file));
-    if (n != 0) {
-        if (errno != 0)
-            perror("shmake");
-        quit("error executing '%s'",shmakefile);
-    }
-    FILE *in = fopen(tmp_file,"r");
-    if (! in) {
-        fprintf(stderr,"shmake: no targets defined?\n");
-        quit("cannot open %s",tmp_file);
-    }
-    while (file_gets(in,buff,sizeof(buff))) {
-        // get any linefeeds back!
-        char *p, *cmd;
-        for (p = buff; *p; p++) {
-            if (*p == '\001') *p = '\n';
-        }
-        // args separated by colon; skip first colon
-        cmd = buff+1;
-        p = strchr(cmd,':');
-        if (p) {
-            *p = '\0';
-            args = (str_t*)str_split(p+1,":");
+    // throwaway expressions are not worth remembering
+    bool remember = ! evaluate && ! *shmake_exp;
+    str_t text = file_read_all(shmakefile,true);
+    if (remember) {
+        StrHash *seen = strhash_new(16);
+        remember = script_is_plain(text,seen);
+        unref(seen);
+        if (! remember && verbose_level > 0) {
+            printf("shmake: '%s' does more than declare targets, so it is run every time\n",shmakefile);
+        }
+    }
+    uint64_t key = 0;
+    char *data = NULL;
+    if (remember) {
+        key = script_key(text);
+        data = script_output(key);
+        if (data) {
+            data = ref(data);
+            if (verbose_level > 0) {
+                printf("shmake: '%s' has not changed, not running it\n",shmakefile);
+            }
+        }
+    }
+    if (! data) {
+        // shmake.sh is rewritten whenever it differs from ours, so upgrading
+        // shmake upgrades it; other shmakes may be reading it at the same time.
+        str_t sh = str_fmt(shmake_sh);
+        file_write_changed("/tmp/shmake.sh",sh);
+        unref(sh);
+        str_t tmp_file = str_fmt("/tmp/shmake.%d",getpid());
+        start = trace_now();
+        int n = system(str_fmt("%s%s %s",(*shmakefile=='/' ? "" : "./"),shmakefile,tmp_file));
+        ++s_processes;
+        if (n != 0) {
+            if (errno != 0)
+                perror("shmake");
+            quit("error executing '%s'",shmakefile);
+        }
+        data = file_read_all(tmp_file,false);
+        if (! data) {
+            fprintf(stderr,"shmake: no targets defined?\n");
+            quit("cannot open %s",tmp_file);
+        }
+        unlink(tmp_file);
+        startup_phase(str_fmt("run %s",shmakefile),start);
+    }
+    start = trace_now();
+    char *p = data, *end = data + array_len(data);
+    needs_prefetch(p,end);
+    startup_phase("resolve needs",start);
+    start = trace_now();
+    while (p < end) {
+        // a record is a count of words, the command and its arguments
+        int n = atoi(next_word(&p,end));
+        if (n < 1) {
+            quit("bad output from '%s'",shmakefile);
+        }
+        char *cmd = next_word(&p,end);
+        args = array_new_ref(str_t,n-1);
+        FOR(i,n-1) {
+            args[i] = str_new(next_word(&p,end));
         }
         if (*cmd=='C') { // general compile target!
             // currently can be C, C++, C99, C++11
@@ -603,7 +1588,7 @@ int run_shmakefile(str_t specific_target) {
                     targets[i] = straight_build(compiler,output_file,VAS(src_file));
                 }
                 Group *G = group_new("cmd",targets);
-                G->name = s_args.name;
+                group_set_name(G,s_args.name);
             }
         } else
         if (str_eq(cmd,"target")){ // T name (prereq..) [command]
@@ -615,6 +1600,15 @@ int run_shmakefile(str_t specific_target) {
             str_t *prereq = array_copy(args,1,-1);
             target(name,group_expand_with_targets(prereq),command);
         } else
+        if (str_eq(cmd,"restat")) { // restat target..
+            FOR(i,array_len(args)) {
+                Target *T = target_from_file(args[i]);
+                if (! T) {
+                    quit("restat: no target %s",args[i]);
+                }
+                T->restat = true;
+            }
+        } else
         if (str_eq(cmd,"all")) { // short for T all ...
             target("all",group_expand_with_targets(args),NULL);
         } else
@@ -636,11 +1630,32 @@ int run_shmakefile(str_t specific_target) {
         }
         unref(args);
     }
-    unlink(tmp_file);
     if (array_len(targets()) == 0) {
         quit("no targets defined","");
     }
+    startup_phase("make targets",start);
+    start = trace_now();
     shmake_flags(verbose_level,testing,quiet);
+    // -j on the command line wins over 'S jobs'; 'auto' means one job per processor.
+    // But if we were started by a make (or shmake) with a jobserver, then we share its jobs.
+    if (jobs == 0 && ! jobs_client() && s_jobs) {
+        if (str_eq(s_jobs,"auto")) {
+            jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        } else {
+            jobs = atoi(s_jobs);
+        }
+    }
+    jobs_set_max(jobs);
+    if (s_job_memory_max && ! testing) {
+        jobs_set_memory_max(parse_size(s_job_memory_max));
+    }
+    str_t worker = getenv("SHMAKE_WORKER");
+    if (worker && *worker && ! testing) {
+        jobs_use_worker(worker);
+    }
+    shmake_change_detection(hashing);
+    cache_setup();
+    shmake_watching(watch);
     // notice the special case; 'all' matches the first target, if not explicitly
     // present.   target_push_to_front() ensures that program/lib targets end here.
     str_t target_name = specific_target ? specific_target : "all";
@@ -649,6 +1664,8 @@ int run_shmakefile(str_t specific_target) {
         if (str_eq(target_name,"clean")) {
             // remove all targets.  (Special logic in target_remove also gets rid of .d files)
             target_forall(target_remove);
+            unity_clean();
+            unlink(SHMAKE_DB);
             return 0;
         } else {
             T = target_first();
@@ -657,19 +1674,52 @@ int run_shmakefile(str_t specific_target) {
     if (T == NULL) {
         quit("no target %s",target_name);
     }
+    startup_phase("get ready to build",start);
+    if (startup_stats) {
+        startup_report();
+    }
+    start = trace_now();
     target_check(T);
+    trace_phase("build",start);
+    build_report(T);
+    if (remember && ! testing) {
+        script_save(text,key,data);
+    }
+    if (watch) {
+        watch_and_build(T,text,key);
+    }
+    unref(data);
+    cache_close(! quiet);
+    db_close();
+    if (str_eq(diagnostics,"stats")) {
+        int lookups, calls;
+        file_stat_counts(&lookups,&calls);
+        printf("shmake: %d file lookups, %d stat calls, %d saved\n",lookups,calls,lookups - calls);
+    }
     return 0;
 }
 
 static void create_shmake(str_t name, str_t expr) {
     file_write_fmt(name,"#!/bin/sh\n. /tmp/shmake.sh\n\n%s\n",expr);
-    exec(str_fmt("chmod +x %s",name));
+    // like 'chmod +x': executable by whoever may read it
+    struct stat st;
+    if (stat(name,&st) != 0 || chmod(name,st.st_mode | (st.st_mode & 0444) >> 2) != 0) {
+        quit("cannot make '%s' executable",name);
+    }
 }
 
 int main(int argc, const char **argv)
 {
     int res = 0;
+    char cwd[4096];
+    s_main_start = clock_us();
+    s_argv = argv;
+    s_start_dir = str_new(getcwd(cwd,sizeof(cwd)) ? cwd : ".");
+    s_makeflags = getenv("MAKEFLAGS") ? str_new(getenv("MAKEFLAGS")) : NULL;
     arg_state = arg_command_line(main_args, argv);
+    if (*worker_socket) {
+        return worker_main(worker_socket,jobs > 0 ? jobs : sysconf(_SC_NPROCESSORS_ONLN));
+    }
     if (*do_create || *shmake_exp) {
         str_t expr = do_create, name = "shmakefile";
         if (*shmake_exp) {
@@ -684,6 +1734,10 @@ int main(int argc, const char **argv)
             shmakefile = name;
         }
     }
+    if (*trace_file) {
+        trace_open(trace_file);
+    }
+    int64_t start = trace_now();
     if (*start_directory) {
         if (chdir(start_directory) != 0) {
             fprintf(stderr,"unable to change directory to '%s'\n",start_directory);
@@ -692,7 +1746,8 @@ int main(int argc, const char **argv)
         printf("shmake: now in %s\n",start_directory);
     }
 
-    PLAT=file_command("uname");
+    struct utsname un;
+    PLAT = str_new(uname(&un) == 0 ? un.sysname : "unknown");
     macosx = str_eq(PLAT,"Darwin");
     setenv("PLAT",PLAT,true);
 
@@ -716,6 +1771,7 @@ int main(int argc, const char **argv)
             shmake_target = *a;
         }
     }
+    startup_phase("start up",start);
     res = run_shmakefile(shmake_target);
     return res;
 }
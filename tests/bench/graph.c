@@ -0,0 +1,71 @@
+/*
+* shmake - a shell-based build tool
+* Copyright (c) 2015, Steve Donovan
+* BSD licence
+*/
+
+// How long does it take to build the dependency graph for a big project?
+// Makes N object targets (default 100000) in groups of 100, each depending on
+// its source and ten of a thousand shared headers, and links them all into one
+// program, as compile_step and linker would. Nothing is run.
+//
+//   $ make bench
+//   $ tests/bench/graph 30000
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <llib/str.h>
+
+#include "shmake.h"
+
+#define GROUP_SIZE 100
+#define HEADERS 1000
+#define HEADERS_PER_FILE 10
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+int main(int argc, char **argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 100000;
+    int ngroups = (n + GROUP_SIZE - 1)/GROUP_SIZE;
+    str_t *headers = array_new_ref(str_t,HEADERS);
+    FOR(i,HEADERS) {
+        headers[i] = str_fmt("include/h%04d.h",i);
+    }
+    str_t *groups = array_new_ref(str_t,ngroups);
+
+    double start = now();
+    int k = 0;
+    FOR(g,ngroups) {
+        int m = n - k < GROUP_SIZE ? n - k : GROUP_SIZE;
+        Target **targets = array_new_ref(Target*,m);
+        FOR(i,m) {
+            str_t *reqs = array_new_ref(str_t,HEADERS_PER_FILE + 1);
+            reqs[0] = str_fmt("src/f%06d.c",k);
+            FOR(h,HEADERS_PER_FILE) {
+                reqs[h+1] = headers[(k*7 + h*131) % HEADERS];
+            }
+            targets[i] = target_new(str_fmt("obj/f%06d.o",k),reqs,"cc -c",NULL);
+            targets[i]->type = TARGET_OBJ;
+            ++k;
+        }
+        Group *G = group_new("cc -c",targets);
+        groups[g] = str_fmt("G%d",g);
+        group_set_name(G,groups[g]);
+    }
+    double made = now();
+    str_t *objs = group_expand_with_targets(groups);
+    double expanded = now();
+    linker("cc","prog",groups,"",NULL,NULL,LINK_EXE);
+    double linked = now();
+
+    printf("%d targets, %d groups, %d objects\n",array_len(targets()),ngroups,array_len(objs));
+    printf("targets %.3fs, group expansion %.3fs, link target %.3fs, total %.3fs\n",
+        made - start, expanded - made, linked - expanded, linked - start);
+    return 0;
+}
@@ -0,0 +1,11 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <llib/all.h>
+#include <llib/template.h>
+
+int main(int argc, char **argv)
+{
+#line 1 "hello.s"
+FOR (i,argc) printf("hello, world %s\n",argv[i]);
+    return 0;
+}
@@ -0,0 +1,36 @@
+# Sourced by the tests which build a scratch project in 'work' and look at what
+# shmake said about it. Each test runs shmake (with 'run') and then checks its
+# output (with 'expect' and 'expect_not'); the first check to fail stops it.
+
+test=$(basename "$PWD")
+work=$PWD/work
+
+fresh() {
+    rm -rf "$work"
+    mkdir -p "$work"
+    cd "$work"
+}
+
+# the shmakefile's body comes from stdin
+shmakefile() {
+    { echo '#!/bin/sh'; echo '. /tmp/shmake.sh'; cat; } > shmakefile
+    chmod +x shmakefile
+}
+
+fail() {
+    echo "FAIL $test: $1"
+    sed 's/^/    /' out
+    exit 1
+}
+
+run() {
+    shmake "$@" > out 2>&1 || fail "shmake $* failed"
+}
+
+expect() {
+    grep -q -e "$1" out || fail "expected '$1'"
+}
+
+expect_not() {
+    ! grep -q -e "$1" out || fail "did not expect '$1'"
+}
@@ -0,0 +1,31 @@
+. ../check.sh
+
+fresh
+echo 'int main() { return 0; }' > a.c
+echo 'int main() { return 0; }' > b.c
+shmakefile <<'X'
+C a a.c
+C b b.c
+all a b
+X
+run
+expect 'linking a'
+expect 'linking b'
+
+# a define for one of them only compiles that one again
+shmakefile <<'X'
+C a a.c -D ONE
+C b b.c
+all a b
+X
+run
+expect 'compiling a.o'
+expect_not 'compiling b.o'
+run
+expect_not 'compiling'
+
+# and so does asking for a debug build, for both
+run -g
+expect 'compiling a.o'
+expect 'compiling b.o'
+echo "$test: ok"
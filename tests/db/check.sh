@@ -0,0 +1,27 @@
+. ../check.sh
+
+fresh
+echo 'int main() { return 0; }' > a.c
+shmakefile <<'X'
+C a a.c
+X
+run
+expect 'linking a'
+
+# as if built before there was a database: the .d files and times will do
+rm .shmake_db
+run
+expect_not 'compiling'
+[ -f .shmake_db ] || fail "no build database"
+
+# a database from another version of shmake is ignored, not misread
+echo 'not a build database' > .shmake_db
+run
+expect 'ignoring'
+expect_not 'compiling'
+run
+expect_not 'ignoring'
+echo '/* changed */' >> a.c
+run
+expect 'compiling a.o'
+echo "$test: ok"
@@ -0,0 +1,29 @@
+. ../check.sh
+
+fresh
+echo 'int main() { return 0; }' > a.c
+shmakefile <<'X'
+C a a.c
+X
+run
+expect 'linking a'
+run
+expect_not 'compiling'
+
+# the targets get their digests now, so nothing is built
+shmakefile <<'X'
+S change-detection hash
+C a a.c
+X
+run
+expect_not 'compiling'
+expect_not 'linking'
+
+# and changes are still noticed: only by contents
+touch a.c
+run
+expect_not 'compiling'
+echo '/* changed */' >> a.c
+run
+expect 'compiling a.o'
+echo "$test: ok"
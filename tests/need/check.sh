@@ -0,0 +1,24 @@
+. ../check.sh
+
+fresh
+echo 'int main() { return FROM_NEED - 1; }' > a.c
+cat > thing.need <<'X'
+#!/bin/sh
+echo ran >> runs
+echo cflags -DFROM_NEED=1
+X
+chmod +x thing.need
+shmakefile <<'X'
+C a a.c -n thing
+X
+run
+expect 'linking a'
+run
+[ "$(wc -l < runs)" -eq 1 ] || fail "the need script ran $(wc -l < runs) times"
+
+# a new script is run again, and its new flags rebuild the object
+sed -i 's/FROM_NEED=1/FROM_NEED=1 -DMORE/' thing.need
+run
+[ "$(wc -l < runs)" -eq 2 ] || fail "the changed need script did not run"
+expect 'compiling a.o'
+echo "$test: ok"
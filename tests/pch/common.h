@@ -0,0 +1,5 @@
+// the heavy headers that every file needs, precompiled once
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
@@ -0,0 +1,10 @@
+#include "words.h"
+
+int main()
+{
+    auto counts = count_words({"one","two","two","three","three","three"});
+    for (auto& c: counts) {
+        std::cout << c.first << " " << c.second << std::endl;
+    }
+    return 0;
+}
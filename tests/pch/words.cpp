@@ -0,0 +1,10 @@
+#include "words.h"
+
+std::map<std::string,int> count_words(const std::vector<std::string>& words)
+{
+    std::map<std::string,int> counts;
+    for (auto& w: words) {
+        ++counts[w];
+    }
+    return counts;
+}
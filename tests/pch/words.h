@@ -0,0 +1 @@
+std::map<std::string,int> count_words(const std::vector<std::string>& words);
@@ -0,0 +1,29 @@
+. ../check.sh
+
+fresh
+echo '#define N 1' > gen.in
+echo '#include "gen.h"
+int main() { return N - 1; }' > m.c
+shmakefile <<'X'
+T gen.h gen.in 'cp gen.in gen.h'
+C m m.c
+X
+run
+expect 'linking m'
+
+# the header is made again, but it is just the same
+touch gen.in
+run -v
+expect 'cp gen.in gen.h'
+expect 'gen.h is unchanged'
+expect_not 'compiling m.o'
+# and it keeps the time cp gave it
+[ gen.h -nt gen.in ] || fail "gen.h has been given an older time"
+run -v
+expect_not 'cp gen.in gen.h'
+
+# but a real change still rebuilds
+echo '#define N 2' > gen.in
+run
+expect 'compiling m.o'
+echo "$test: ok"
@@ -0,0 +1,31 @@
+. ../check.sh
+
+fresh
+echo 'int main() { return 0; }' > a.c
+shmakefile <<'X'
+C a *.c
+X
+run
+expect 'linking a'
+run -v
+expect 'not running it'
+
+# a new file which the glob matches means running it again
+echo 'int b;' > b.c
+run -v
+expect_not 'not running it'
+expect 'b.c -o b.o'
+run -v
+expect 'not running it'
+
+# one which does more than declare targets is run every time
+shmakefile <<'X'
+echo declaring
+C a *.c
+X
+run -v
+expect 'run every time'
+expect 'declaring'
+run -v
+expect 'declaring'
+echo "$test: ok"
@@ -0,0 +1,393 @@
+/*
+* shmake - a shell-based build tool
+* Copyright (c) 2015, Steve Donovan
+* BSD licence
+*/
+
+// The object cache keeps compiled object files (and their .d files) so that
+// compiling the same source with the same command again, say after switching
+// branches or between the gcc-release and gcc-debug out-dirs, is just a matter
+// of linking a file into place.
+//
+// It works like ccache's 'direct mode'. The compiler, the command and the
+// source's contents give a key, which finds a _manifest_. Each line of the
+// manifest is one result that we have seen, followed by every file it
+// depended on (from the .d file) and that file's digest. If all those
+// digests match the files we have now, the result is ours.
+//
+// Entries live in a two-level directory, e.g. ~/.cache/shmake/3f/3f9a....o;
+// the cache is kept below its maximum size by removing the least recently
+// used files, and a hit refreshes an entry's time.
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <llib/file.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "cache.h"
+#include "utils.h"
+
+// a manifest is started again when it gets this big
+#define MAX_MANIFEST 16384
+
+static str_t s_dir;
+static int64_t s_max;
+static str_t s_cwd;
+static StrHash *s_compilers;
+static int s_hits, s_misses;
+static int64_t s_stored;
+
+static void mkdir_p(str_t path) {
+    char *p = (char*)str_new(path);
+    for (char *s = strchr(p+1,'/'); s; s = strchr(s+1,'/')) {
+        *s = '\0';
+        mkdir(p,0777);
+        *s = '/';
+    }
+    mkdir(p,0777);
+    unref(p);
+}
+
+bool cache_open(str_t dir, int64_t max_size) {
+    char cwd[4096];
+    mkdir_p(dir);
+    if (access(dir,W_OK) != 0) {
+        fprintf(stderr,"shmake: cannot use cache directory %s\n",dir);
+        return false;
+    }
+    s_dir = str_new(dir);
+    s_max = max_size;
+    s_cwd = str_new(getcwd(cwd,sizeof(cwd)) ? cwd : "");
+    s_compilers = strhash_new(8);
+    return true;
+}
+
+bool cache_is_open() {
+    return s_dir != NULL;
+}
+
+static str_t entry_path(uint64_t key, str_t ext) {
+    char hex[17];
+    snprintf(hex,sizeof(hex),"%016llx",(unsigned long long)key);
+    return str_fmt("%s/%.2s/%s%s",s_dir,hex,hex,ext);
+}
+
+// the compiler is identified by where it is and when it was installed
+static uint64_t compiler_id(str_t cmd) {
+    int len = strcspn(cmd," ");
+    char *name = str_new_size(len);
+    strncpy(name,cmd,len);
+    uint64_t *id = (uint64_t*)strhash_get(s_compilers,name);
+    if (id) {
+        unref(name);
+        return *id;
+    }
+    id = array_new(uint64_t,1);
+    *id = hash_str(name,0);
+    str_t path = getenv("PATH");
+    char **dirs = strchr(name,'/') ? NULL : str_split(path ? path : "/usr/bin:/bin",":");
+    for (char **d = dirs; d && *d; d++) {
+        str_t exe = str_fmt("%s/%s",*d,name);
+        FileStat *st = file_stat(exe);
+        if (st->exists && ! st->is_dir) {
+            *id = hash_str(exe,0);
+            *id = hash_bytes(&st->mtime,sizeof(st->mtime),*id);
+            *id = hash_bytes(&st->size,sizeof(st->size),*id);
+            break;
+        }
+    }
+    unref(dirs);
+    strhash_put(s_compilers,name,id);
+    return *id;
+}
+
+// the key for an object's manifest: the compiler, the command apart from its output,
+// the source's contents and the directory we are in (which goes into debug info)
+static bool manifest_key(Target *T, uint64_t *key) {
+    str_t cmd = (str_t)T->data;
+    str_t out = str_fmt(" -o %s",T->name);
+    // split debug info is in a .dwo file which we don't keep, and a precompiled
+    // header is only good for exactly the compiler which made it
+    if (strstr(cmd,"-gsplit-dwarf") || str_ends_with(T->name,".gch") || ! str_ends_with(cmd,out)) {
+        unref(out);
+        return false;
+    }
+    int len = strlen(cmd) - strlen(out);
+    unref(out);
+    char *base = str_new_size(len);
+    strncpy(base,cmd,len);
+    char *source = strrchr(base,' ');
+    uint64_t digest;
+    if (! source || ! file_digest(source + 1,&digest)) {
+        unref(base);
+        return false;
+    }
+    uint64_t h = compiler_id(base);
+    h = hash_str(base,h);
+    h = hash_str(s_cwd,h);
+    *key = hash_bytes(&digest,sizeof(digest),h);
+    unref(base);
+    return true;
+}
+
+static bool copy_file(str_t src, str_t dest) {
+    int in = open(src,O_RDONLY);
+    if (in == -1)
+        return false;
+    int out = open(dest,O_WRONLY | O_CREAT | O_TRUNC,0666);
+    if (out == -1) {
+        close(in);
+        return false;
+    }
+    bool ok = true;
+#ifdef FICLONE
+    if (ioctl(out,FICLONE,in) == 0) {
+        close(in);
+        close(out);
+        return true;
+    }
+#endif
+    char buff[65536];
+    ssize_t n;
+    while ((n = read(in,buff,sizeof(buff))) > 0) {
+        if (write(out,buff,n) != n) {
+            ok = false;
+            break;
+        }
+    }
+    if (n < 0)
+        ok = false;
+    close(in);
+    close(out);
+    return ok;
+}
+
+// a hard link if we can, otherwise a reflink or a plain copy
+static bool link_or_copy(str_t src, str_t dest) {
+    return link(src,dest) == 0 || copy_file(src,dest);
+}
+
+// put a cached file in place. It gets the current time, so it is newer than its
+// sources; if it is a hard link, this also marks the entry as recently used.
+static bool restore(str_t entry, str_t dest) {
+    unlink(dest);
+    file_stat_forget(dest);
+    if (! link_or_copy(entry,dest))
+        return false;
+    utimensat(AT_FDCWD,dest,NULL,0);
+    utimensat(AT_FDCWD,entry,NULL,0);
+    return true;
+}
+
+// The cached .d file names the object it was made for, which may have been in
+// another out-dir, so it is written out again naming this one.
+static bool restore_dfile(str_t entry, str_t dest, str_t obj) {
+    str_t text = file_read_all(entry,false);
+    char *colon = text ? strchr(text,':') : NULL;
+    bool ok = colon != NULL;
+    if (ok) {
+        unlink(dest);
+        file_stat_forget(dest);
+        ok = file_write_fmt(dest,"%s%s",obj,colon);
+        utimensat(AT_FDCWD,entry,NULL,0);
+    }
+    unref(text);
+    return ok;
+}
+
+// does this line of the manifest match the files as they are now?
+static bool manifest_match(char **fields, uint64_t *result) {
+    int n = array_len(fields);
+    if (n < 1 || n % 2 != 1)
+        return false;
+    for (int i = 1; i < n; i += 2) {
+        uint64_t digest;
+        if (! file_digest(fields[i],&digest) || digest != strtoull(fields[i+1],NULL,16))
+            return false;
+    }
+    *result = strtoull(fields[0],NULL,16);
+    return true;
+}
+
+// bring an object file (and its .d file) from the cache, if we have it.
+bool cache_fetch(Target *T) {
+    uint64_t key;
+    if (! manifest_key(T,&key)) {
+        return false;
+    }
+    bool hit = false;
+    str_t manifest = file_read_all(entry_path(key,".manifest"),true);
+    char **lines = manifest ? str_split(manifest,"\n") : NULL;
+    for (char **L = lines; L && *L && ! hit; L++) {
+        char **fields = str_split(*L,"\t");
+        uint64_t result;
+        if (manifest_match(fields,&result)) {
+            str_t obj = entry_path(result,".o"), dfile = entry_path(result,".d");
+            hit = file_exists(obj,"r") && file_exists(dfile,"r")
+                && restore(obj,T->name) && restore_dfile(dfile,dfile_name(T->name),T->name);
+        }
+        unref(fields);
+    }
+    dispose(lines,manifest);
+    if (hit) {
+        ++s_hits;
+    } else {
+        ++s_misses;
+    }
+    return hit;
+}
+
+static void store(str_t src, str_t entry) {
+    if (file_exists(entry,"r"))
+        return;
+    str_t tmp = str_fmt("%s.%d",entry,getpid());
+    if (link_or_copy(src,tmp) && rename(tmp,entry) == 0) {
+        struct stat st;
+        if (stat(entry,&st) == 0)
+            s_stored += st.st_size;
+    } else {
+        unlink(tmp);
+    }
+    unref(tmp);
+}
+
+// a freshly compiled object file goes into the cache, and its manifest
+// learns which files it depended on.
+void cache_store(Target *T) {
+    uint64_t key;
+    if (! manifest_key(T,&key)) {
+        return;
+    }
+    str_t dfile = dfile_name(T->name);
+    str_t *deps = prereq_from_dfile(dfile);
+    if (! deps) {
+        return;
+    }
+    str_t **line = seq_new_ref(str_t);
+    seq_add(line,str_new(""));
+    uint64_t result = key;
+    FOR(i,array_len(deps)) {
+        uint64_t digest;
+        if (! *deps[i])
+            continue;
+        if (! file_digest(deps[i],&digest)) {
+            dispose(deps,line);
+            return;
+        }
+        result = hash_str(deps[i],result);
+        result = hash_bytes(&digest,sizeof(digest),result);
+        seq_add(line,str_new(deps[i]));
+        seq_add(line,str_fmt("%016llx",(unsigned long long)digest));
+    }
+    str_t *fields = seq_array_ref(line);
+    unref(fields[0]);
+    fields[0] = str_fmt("%016llx",(unsigned long long)result);
+
+    str_t obj = entry_path(result,".o");
+    mkdir_p(file_dirname(obj));
+    store(T->name,obj);
+    store(dfile,entry_path(result,".d"));
+
+    str_t manifest = entry_path(key,".manifest");
+    mkdir_p(file_dirname(manifest));
+    int flags = file_stat(manifest)->size > MAX_MANIFEST ? O_TRUNC : O_APPEND;
+    int fd = open(manifest,O_WRONLY | O_CREAT | flags,0666);
+    if (fd != -1) {
+        str_t text = str_fmt("%s\n",str_concat((char**)fields,"\t"));
+        if (write(fd,text,strlen(text)) < 0) {
+            perror(manifest);
+        }
+        close(fd);
+        file_stat_forget(manifest);
+    }
+    dispose(fields,deps);
+}
+
+typedef struct Entry_ {
+    str_t path;
+    int64_t mtime, size;
+} Entry;
+
+static int entry_cmp(const void *a, const void *b) {
+    int64_t t1 = ((Entry*)a)->mtime, t2 = ((Entry*)b)->mtime;
+    return t1 < t2 ? -1 : t1 > t2;
+}
+
+// remove the least recently used files until the cache is comfortably
+// within its limit, returning the new size
+static int64_t cache_evict() {
+    Entry *entries = NULL;
+    int n = 0, cap = 0;
+    int64_t total = 0;
+    FOR(i,256) {
+        str_t sub = str_fmt("%s/%02x",s_dir,i);
+        DIR *d = opendir(sub);
+        struct dirent *e;
+        while (d && (e = readdir(d)) != NULL) {
+            struct stat st;
+            str_t path = str_fmt("%s/%s",sub,e->d_name);
+            if (stat(path,&st) != 0 || ! S_ISREG(st.st_mode)) {
+                unref(path);
+                continue;
+            }
+            if (n == cap) {
+                cap = cap ? 2*cap : 1024;
+                entries = realloc(entries,cap*sizeof(Entry));
+            }
+            entries[n].path = path;
+            entries[n].mtime = st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec;
+            entries[n].size = st.st_size;
+            total += st.st_size;
+            ++n;
+        }
+        if (d)
+            closedir(d);
+        unref(sub);
+    }
+    qsort(entries,n,sizeof(Entry),entry_cmp);
+    FOR(i,n) {
+        if (total > s_max*8/10 && unlink(entries[i].path) == 0) {
+            total -= entries[i].size;
+        }
+        unref(entries[i].path);
+    }
+    free(entries);
+    return total;
+}
+
+// the size of the cache is kept in a file, which is only updated
+// (under a lock) when we have added something.
+void cache_close(bool report) {
+    if (! s_dir)
+        return;
+    if (s_stored > 0) {
+        str_t lock = str_fmt("%s/lock",s_dir);
+        int fd = open(lock,O_RDWR | O_CREAT,0666);
+        if (fd != -1 && flock(fd,LOCK_EX) == 0) {
+            str_t size_file = str_fmt("%s/size",s_dir);
+            str_t text = file_read_all(size_file,true);
+            int64_t size = (text ? atoll(text) : 0) + s_stored;
+            if (size > s_max) {
+                size = cache_evict();
+            }
+            file_write_fmt(size_file,"%lld\n",(long long)size);
+            flock(fd,LOCK_UN);
+        }
+        if (fd != -1)
+            close(fd);
+    }
+    if (report && s_hits + s_misses > 0) {
+        printf("shmake: cache %d hits, %d misses\n",s_hits,s_misses);
+    }
+}
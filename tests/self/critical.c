@@ -0,0 +1,240 @@
+/*
+* shmake - a shell-based build tool
+* Copyright (c) 2015, Steve Donovan
+* BSD licence
+*/
+
+// '--critical-path' reports the longest chain of actions in the build just done.
+// Each target costs what its own action took (its self time); the chain
+// which finishes last decides how long the build takes however many jobs we run.
+// A target off the chain has 'slack', which is how much longer it could take
+// before the build would take longer. '--graph FILE' also writes the targets
+// and their prerequisites for Graphviz, with the critical chain in red.
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <llib/array.h>
+
+#include "critical.h"
+#include "utils.h"
+
+typedef struct Node_ {
+    Target *T;
+    int64_t self;   // its action's time; zero if it was up to date
+    int64_t finish; // earliest it could finish, with everything it needs before it
+    int64_t tail;   // the longest chain from it finishing to the end of the build
+    bool critical;
+} Node;
+
+static Node *s_nodes;
+static int s_count;
+static StrHash *s_index;
+
+static Target *as_target(File *f) {
+    Target *T = target_from_file(f->name);
+    return (File*)T == f ? T : NULL;
+}
+
+static Node *node_of(Target *T) {
+    return (Node*)strhash_get(s_index,T->name);
+}
+
+// visit the targets in depth-first order, so that prerequisites come first
+static void visit(Target *T, StrHash *seen) {
+    if (strhash_get(seen,T->name))
+        return;
+    strhash_put(seen,T->name,T);
+    if (T->prereq) {
+        FOR(i,array_len(T->prereq)) {
+            Target *P = as_target(T->prereq[i]);
+            if (P)
+                visit(P,seen);
+        }
+    }
+    s_nodes = realloc(s_nodes,++s_count*sizeof(Node));
+    Node *N = &s_nodes[s_count-1];
+    N->T = T;
+    N->self = T->elapsed > 0 ? T->elapsed : 0;
+    N->finish = N->tail = 0;
+    N->critical = false;
+}
+
+static void analyse(Target *root) {
+    StrHash *seen = strhash_new(256);
+    s_count = 0;
+    visit(root,seen);
+    unref(seen);
+    s_index = strhash_new(2*s_count);
+    FOR(i,s_count) {
+        strhash_put(s_index,s_nodes[i].T->name,&s_nodes[i]);
+    }
+    // forwards, a target can finish once its slowest prerequisite has
+    FOR(i,s_count) {
+        Node *N = &s_nodes[i];
+        int64_t start = 0;
+        if (N->T->prereq) {
+            FOR(j,array_len(N->T->prereq)) {
+                Target *P = as_target(N->T->prereq[j]);
+                if (P && node_of(P)->finish > start)
+                    start = node_of(P)->finish;
+            }
+        }
+        N->finish = start + N->self;
+    }
+    // backwards, a target must be followed by the longest chain which needs it
+    for (int i = s_count - 1; i >= 0; i--) {
+        Node *N = &s_nodes[i];
+        if (! N->T->prereq)
+            continue;
+        FOR(j,array_len(N->T->prereq)) {
+            Target *P = as_target(N->T->prereq[j]);
+            if (P && node_of(P)->tail < N->self + N->tail)
+                node_of(P)->tail = N->self + N->tail;
+        }
+    }
+}
+
+// the critical chain, from the root back to its first action
+static Node **critical_chain() {
+    Node ***chain = seq_new(Node*);
+    Node *N = &s_nodes[s_count-1];
+    while (N) {
+        N->critical = true;
+        seq_add(chain,N);
+        Node *next = NULL;
+        if (N->T->prereq) {
+            FOR(j,array_len(N->T->prereq)) {
+                Target *P = as_target(N->T->prereq[j]);
+                if (P && node_of(P)->finish > 0 && (! next || node_of(P)->finish > next->finish))
+                    next = node_of(P);
+            }
+        }
+        N = next;
+    }
+    return (Node**)seq_array_ref(chain);
+}
+
+static int64_t slack_of(Node *N, int64_t length) {
+    return length - (N->finish + N->tail);
+}
+
+static int by_slack(const void *a, const void *b) {
+    Node *na = *(Node**)a, *nb = *(Node**)b;
+    // least slack is the longest chain through a target
+    int64_t sa = na->finish + na->tail, sb = nb->finish + nb->tail;
+    if (sa != sb)
+        return sa > sb ? -1 : 1;
+    return strcmp(na->T->name,nb->T->name);
+}
+
+static double secs(int64_t us) {
+    return us/1.0e6;
+}
+
+static void report(Node **chain) {
+    int64_t length = s_nodes[s_count-1].finish, total = 0;
+    int ran = 0;
+    FOR(i,s_count) {
+        if (s_nodes[i].T->elapsed >= 0) {
+            total += s_nodes[i].self;
+            ++ran;
+        }
+    }
+    if (ran == 0) {
+        printf("shmake: nothing was built, so there is no critical path\n");
+        return;
+    }
+    printf("shmake: critical path %.3fs; %d actions took %.3fs",secs(length),ran,secs(total));
+    if (length > 0)
+        printf(" (parallelism %.1f)",(double)total/length);
+    printf("\n%9s %9s  %s\n","self","slack","target");
+    for (int i = array_len(chain) - 1; i >= 0; i--) {
+        if (chain[i]->T->elapsed >= 0)
+            printf("%8.3fs %9s  %s\n",secs(chain[i]->self),"-",chain[i]->T->name);
+    }
+    Node ***others = seq_new(Node*);
+    FOR(i,s_count) {
+        if (! s_nodes[i].critical && s_nodes[i].T->elapsed >= 0)
+            seq_add(others,&s_nodes[i]);
+    }
+    Node **rest = (Node**)seq_array_ref(others);
+    qsort(rest,array_len(rest),sizeof(Node*),by_slack);
+    FOR(i,array_len(rest)) {
+        printf("%8.3fs %8.3fs  %s\n",secs(rest[i]->self),secs(slack_of(rest[i],length)),rest[i]->T->name);
+    }
+    unref(rest);
+}
+
+static void dot_str(FILE *out, str_t s) {
+    fputc('"',out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\',out);
+        fputc(*s,out);
+    }
+    fputc('"',out);
+}
+
+// targets are boxes, labelled with their self time; other files are notes
+static bool write_graph(str_t path) {
+    FILE *out = fopen(path,"w");
+    if (! out) {
+        perror(path);
+        return false;
+    }
+    StrHash *files = strhash_new(256);
+    fprintf(out,"digraph build {\n  rankdir=LR;\n  node [shape=box,fontsize=10];\n");
+    FOR(i,s_count) {
+        Node *N = &s_nodes[i];
+        fprintf(out,"  ");
+        dot_str(out,N->T->name);
+        if (N->T->elapsed >= 0)
+            fprintf(out," [label=\"%s\\n%.3fs\"",N->T->name,secs(N->self));
+        else
+            fprintf(out," [style=dashed");
+        fprintf(out,"%s];\n",N->critical ? ",color=red,penwidth=2" : "");
+    }
+    FOR(i,s_count) {
+        Node *N = &s_nodes[i];
+        if (! N->T->prereq)
+            continue;
+        FOR(j,array_len(N->T->prereq)) {
+            File *f = N->T->prereq[j];
+            Target *P = as_target(f);
+            if (! P && ! strhash_get(files,f->name)) {
+                strhash_put(files,f->name,f);
+                fprintf(out,"  ");
+                dot_str(out,f->name);
+                fprintf(out," [shape=note,color=gray];\n");
+            }
+            fprintf(out,"  ");
+            dot_str(out,f->name);
+            fprintf(out," -> ");
+            dot_str(out,N->T->name);
+            if (P && N->critical && node_of(P)->critical)
+                fprintf(out," [color=red,penwidth=2]");
+            else
+            if (! P)
+                fprintf(out," [color=gray]");
+            fprintf(out,";\n");
+        }
+    }
+    fprintf(out,"}\n");
+    fclose(out);
+    unref(files);
+    return true;
+}
+
+// T has just been built (or found to be up to date); say what took the time.
+void critical_path_report(Target *T, bool print, str_t graph) {
+    analyse(T);
+    Node **chain = critical_chain();
+    if (print)
+        report(chain);
+    if (graph && *graph)
+        write_graph(graph);
+    unref(chain);
+    unref(s_index);
+    s_index = NULL;
+}
@@ -0,0 +1,474 @@
+/*
+* shmake - a shell-based build tool
+* Copyright (c) 2015, Steve Donovan
+* BSD licence
+*/
+
+// The build database (.shmake_db) remembers things between runs: the
+// digests of files, and for each target its command, when it was built and
+// the dependencies discovered by the compiler. So on a no-op build we read
+// this one file rather than every .d file. It also keeps what the shmakefile
+// wrote, so that it need not be run again if nothing it depends on has changed,
+// and how needs were resolved, so that their scripts and pkg-config need not be.
+// It is a binary append-only log: a header, then records
+// which are a kind byte, a 32-bit payload length and the payload. Integers are
+// in host byte order and strings are length-prefixed. When loading, a later
+// record for the same name replaces an earlier one, so updating means just
+// appending; the log is compacted when it has too many stale records.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <llib/file.h>
+
+#include "db.h"
+#include "utils.h"
+
+#define DB_MAGIC "SHMAKEDB"
+#define DB_VERSION 1
+
+enum {
+    DB_FILE = 'F',
+    DB_TARGET = 'T',
+    DB_SCRIPT = 'S',
+    DB_NEED = 'N'
+};
+
+static str_t s_path;
+static FILE *s_out;
+static StrHash *s_files, *s_targets, *s_scripts, *s_needs;
+static int s_records; // in the file, including stale ones
+
+/// writing records
+
+typedef struct Record_ {
+    unsigned char *data;
+    int len, cap;
+} Record;
+
+static void put(Record *r, const void *p, int n) {
+    if (r->len + n > r->cap) {
+        r->cap = 2*(r->len + n);
+        r->data = realloc(r->data,r->cap);
+    }
+    memcpy(r->data + r->len,p,n);
+    r->len += n;
+}
+
+static void put_u64(Record *r, uint64_t v) {
+    put(r,&v,sizeof(v));
+}
+
+static void put_u32(Record *r, uint32_t v) {
+    put(r,&v,sizeof(v));
+}
+
+static void put_str(Record *r, str_t s) {
+    uint32_t n = s ? strlen(s) : 0;
+    put_u32(r,n);
+    put(r,s,n);
+}
+
+static void record_write(FILE *out, int kind, Record *r) {
+    unsigned char k = kind;
+    uint32_t len = r->len;
+    fwrite(&k,1,1,out);
+    fwrite(&len,sizeof(len),1,out);
+    fwrite(r->data,1,r->len,out);
+    free(r->data);
+    ++s_records;
+}
+
+static void file_encode(Record *r, DbFile *f) {
+    put_str(r,f->name);
+    put_u64(r,f->mtime);
+    put_u64(r,f->size);
+    put_u64(r,f->digest);
+    // one more than the number of includes, so that zero means 'not scanned'
+    int n = f->includes ? array_len(f->includes) + 1 : 0;
+    put_u32(r,n);
+    FOR(i,n - 1) {
+        put_str(r,f->includes[i]);
+    }
+}
+
+static void target_encode(Record *r, DbTarget *t) {
+    put_str(r,t->name);
+    put_u64(r,t->inputs);
+    put_u64(r,t->stamp);
+    put_str(r,t->command);
+    int n = t->deps ? array_len(t->deps) : 0;
+    put_u32(r,n);
+    FOR(i,n) {
+        put_str(r,t->deps[i]);
+    }
+    put_u64(r,t->signature);
+    put_u64(r,t->user);
+    put_u64(r,t->sys);
+    put_u64(r,t->maxrss);
+    put_u64(r,t->nvcsw);
+    put_u64(r,t->nivcsw);
+    put_u64(r,t->changed);
+}
+
+static void script_encode(Record *r, DbScript *s) {
+    put_str(r,s->name);
+    put_u64(r,s->key);
+    int n = s->watch ? array_len(s->watch) : 0;
+    put_u32(r,n);
+    FOR(i,n) {
+        put_str(r,s->watch[i]);
+        put_u64(r,s->times[i]);
+        put_u64(r,s->listings[i]);
+    }
+    int len = s->output ? array_len(s->output) : 0;
+    put_u32(r,len);
+    put(r,s->output,len);
+}
+
+static void need_encode(Record *r, DbNeed *n) {
+    put_str(r,n->name);
+    put_u64(r,n->key);
+    put_str(r,n->cflags);
+    put_str(r,n->lflags);
+    put_str(r,n->search_path);
+}
+
+static void encode(Record *r, int kind, void *obj) {
+    if (kind == DB_FILE) {
+        file_encode(r,(DbFile*)obj);
+    } else
+    if (kind == DB_TARGET) {
+        target_encode(r,(DbTarget*)obj);
+    } else
+    if (kind == DB_NEED) {
+        need_encode(r,(DbNeed*)obj);
+    } else {
+        script_encode(r,(DbScript*)obj);
+    }
+}
+
+static void append(int kind, void *obj) {
+    if (! s_out)
+        return;
+    Record r = {NULL,0,0};
+    encode(&r,kind,obj);
+    record_write(s_out,kind,&r);
+    // the log is written as we go, so a failed build remembers what did get done
+    fflush(s_out);
+}
+
+/// reading records
+
+typedef struct Reader_ {
+    const unsigned char *p, *end;
+} Reader;
+
+static bool get(Reader *r, void *p, int n) {
+    if (r->p + n > r->end)
+        return false;
+    memcpy(p,r->p,n);
+    r->p += n;
+    return true;
+}
+
+static uint64_t get_u64(Reader *r) {
+    uint64_t v = 0;
+    get(r,&v,sizeof(v));
+    return v;
+}
+
+static uint32_t get_u32(Reader *r) {
+    uint32_t v = 0;
+    get(r,&v,sizeof(v));
+    return v;
+}
+
+static str_t get_str(Reader *r) {
+    uint32_t n = 0;
+    if (! get(r,&n,sizeof(n)) || r->p + n > r->end)
+        return NULL;
+    char *s = str_new_size(n);
+    get(r,s,n);
+    return s;
+}
+
+static void DbFile_dispose(DbFile *f) {
+    dispose(f->name,f->includes);
+}
+
+static void DbTarget_dispose(DbTarget *t) {
+    dispose(t->name,t->command,t->deps);
+}
+
+static void DbScript_dispose(DbScript *s) {
+    dispose(s->name,s->watch,s->times,s->listings,s->output);
+}
+
+static void DbNeed_dispose(DbNeed *n) {
+    dispose(n->name,n->cflags,n->lflags,n->search_path);
+}
+
+static void record_read(int kind, Reader *r) {
+    str_t name = get_str(r);
+    if (! name)
+        return;
+    if (kind == DB_FILE) {
+        DbFile *f = db_file_new(name);
+        f->mtime = get_u64(r);
+        f->size = get_u64(r);
+        f->digest = get_u64(r);
+        // older records stop here, and were not scanned
+        unref(f->includes);
+        f->includes = NULL;
+        int n = get_u32(r);
+        if (n > 0) {
+            f->includes = array_new_ref(str_t,n - 1);
+            FOR(i,n - 1) {
+                f->includes[i] = get_str(r);
+            }
+        }
+    } else
+    if (kind == DB_TARGET) {
+        DbTarget *t = db_target_new(name);
+        t->inputs = get_u64(r);
+        t->stamp = get_u64(r);
+        unref(t->command);
+        t->command = get_str(r);
+        unref(t->deps);
+        t->deps = NULL;
+        int n = get_u32(r);
+        if (n > 0) {
+            t->deps = array_new_ref(str_t,n);
+            FOR(i,n) {
+                t->deps[i] = get_str(r);
+            }
+        }
+        t->signature = get_u64(r);
+        // older records stop here, and read as zero
+        t->user = get_u64(r);
+        t->sys = get_u64(r);
+        t->maxrss = get_u64(r);
+        t->nvcsw = get_u64(r);
+        t->nivcsw = get_u64(r);
+        t->changed = get_u64(r);
+    } else
+    if (kind == DB_SCRIPT) {
+        DbScript *s = db_script_new(name);
+        s->key = get_u64(r);
+        dispose(s->watch,s->times,s->listings,s->output);
+        int n = get_u32(r);
+        s->watch = array_new_ref(str_t,n);
+        s->times = array_new(int64_t,n);
+        s->listings = array_new(uint64_t,n);
+        FOR(i,n) {
+            s->watch[i] = get_str(r);
+            s->times[i] = get_u64(r);
+            s->listings[i] = get_u64(r);
+        }
+        uint32_t len = get_u32(r);
+        if (r->p + len > r->end) {
+            len = 0;
+            s->key = 0; // can never match
+        }
+        s->output = array_new(char,len);
+        get(r,s->output,len);
+    } else
+    if (kind == DB_NEED) {
+        DbNeed *N = db_need_new(name);
+        N->key = get_u64(r);
+        dispose(N->cflags,N->lflags,N->search_path);
+        N->cflags = get_str(r);
+        N->lflags = get_str(r);
+        // older records stop here
+        N->search_path = get_str(r);
+    }
+    unref(name);
+}
+
+static void db_load(str_t path) {
+    char *data = file_read_all(path,false);
+    if (! data)
+        return;
+    Reader rdr = {(unsigned char*)data, (unsigned char*)data + array_len(data)};
+    char magic[8];
+    uint32_t version;
+    if (! get(&rdr,magic,8) || memcmp(magic,DB_MAGIC,8) != 0
+        || ! get(&rdr,&version,sizeof(version)) || version != DB_VERSION) {
+        fprintf(stderr,"shmake: ignoring '%s', not a build database for this version\n",path);
+        unref(data);
+        unlink(path);
+        return;
+    }
+    unsigned char kind;
+    uint32_t len;
+    while (get(&rdr,&kind,1) && get(&rdr,&len,sizeof(len))) {
+        if (rdr.p + len > rdr.end) // truncated by a crash; ignore the tail
+            break;
+        Reader rec = {rdr.p, rdr.p + len};
+        record_read(kind,&rec);
+        rdr.p += len;
+        ++s_records;
+    }
+    unref(data);
+}
+
+static FILE *db_create(str_t path) {
+    FILE *out = fopen(path,"wb");
+    if (! out)
+        return NULL;
+    uint32_t version = DB_VERSION;
+    fwrite(DB_MAGIC,1,8,out);
+    fwrite(&version,sizeof(version),1,out);
+    s_records = 0;
+    return out;
+}
+
+// load the database, and open it for appending new records.
+bool db_open(str_t path) {
+    if (s_out)
+        return true;
+    s_path = path;
+    s_files = strhash_new(1024);
+    s_targets = strhash_new(1024);
+    s_scripts = strhash_new(4);
+    s_needs = strhash_new(16);
+    db_load(path);
+    if (file_exists(path,"r")) {
+        s_out = fopen(path,"ab");
+    } else {
+        s_out = db_create(path);
+    }
+    if (! s_out) {
+        perror(path);
+        return false;
+    }
+    return true;
+}
+
+bool db_is_open() {
+    return s_out != NULL;
+}
+
+// rewrite the database with only the live records
+static void compact_table(FILE *out, int kind, StrHash *h) {
+    FOR(i,h->size) {
+        if (h->keys[i]) {
+            Record r = {NULL,0,0};
+            encode(&r,kind,h->values[i]);
+            record_write(out,kind,&r);
+        }
+    }
+}
+
+static void db_compact() {
+    str_t tmp = str_fmt("%s.tmp",s_path);
+    FILE *out = db_create(tmp);
+    if (! out)
+        return;
+    compact_table(out,DB_FILE,s_files);
+    compact_table(out,DB_TARGET,s_targets);
+    compact_table(out,DB_SCRIPT,s_scripts);
+    compact_table(out,DB_NEED,s_needs);
+    fclose(out);
+    rename(tmp,s_path);
+}
+
+void db_close() {
+    if (! s_out)
+        return;
+    fclose(s_out);
+    s_out = NULL;
+    int live = s_files->count + s_targets->count + s_scripts->count + s_needs->count;
+    if (s_records > 2*live + 1000) {
+        db_compact();
+    }
+}
+
+DbFile *db_file(str_t name) {
+    if (! s_files)
+        return NULL;
+    return (DbFile*)strhash_get(s_files,name);
+}
+
+// the record for this file, created if it's not already known
+DbFile *db_file_new(str_t name) {
+    DbFile *f = db_file(name);
+    if (! f) {
+        f = obj_new(DbFile,DbFile_dispose);
+        memset(f,0,sizeof(DbFile));
+        f->name = str_new(name);
+        strhash_put(s_files,f->name,f);
+    }
+    return f;
+}
+
+void db_file_save(DbFile *f) {
+    append(DB_FILE,f);
+}
+
+DbTarget *db_target(str_t name) {
+    if (! s_targets)
+        return NULL;
+    return (DbTarget*)strhash_get(s_targets,name);
+}
+
+// the record for this target, created if it's not already known
+DbTarget *db_target_new(str_t name) {
+    DbTarget *t = db_target(name);
+    if (! t) {
+        t = obj_new(DbTarget,DbTarget_dispose);
+        memset(t,0,sizeof(DbTarget));
+        t->name = str_new(name);
+        strhash_put(s_targets,t->name,t);
+    }
+    return t;
+}
+
+void db_target_save(DbTarget *t) {
+    append(DB_TARGET,t);
+}
+
+DbScript *db_script(str_t name) {
+    if (! s_scripts)
+        return NULL;
+    return (DbScript*)strhash_get(s_scripts,name);
+}
+
+// the record for this shmakefile, created if it's not already known
+DbScript *db_script_new(str_t name) {
+    DbScript *s = db_script(name);
+    if (! s) {
+        s = obj_new(DbScript,DbScript_dispose);
+        memset(s,0,sizeof(DbScript));
+        s->name = str_new(name);
+        strhash_put(s_scripts,s->name,s);
+    }
+    return s;
+}
+
+void db_script_save(DbScript *s) {
+    append(DB_SCRIPT,s);
+}
+
+DbNeed *db_need(str_t name) {
+    if (! s_needs)
+        return NULL;
+    return (DbNeed*)strhash_get(s_needs,name);
+}
+
+// the record for this need, created if it's not already known
+DbNeed *db_need_new(str_t name) {
+    DbNeed *n = db_need(name);
+    if (! n) {
+        n = obj_new(DbNeed,DbNeed_dispose);
+        memset(n,0,sizeof(DbNeed));
+        n->name = str_new(name);
+        strhash_put(s_needs,n->name,n);
+    }
+    return n;
+}
+
+void db_need_save(DbNeed *n) {
+    append(DB_NEED,n);
+}
@@ -0,0 +1,177 @@
+/*
+* shmake - a shell-based build tool
+* Copyright (c) 2015, Steve Donovan
+* BSD licence
+*/
+
+// Before a file has been compiled there is no .d file to say what it includes,
+// so we find out for ourselves, by looking for #include lines and resolving them
+// as the compiler would: "foo.h" next to the including file and then along the include
+// directories, <foo.h> just along the include directories (from -I, and any -I, -iquote
+// or -isystem in the flags, including those of needs; -iquote is only for "foo.h").
+// Headers which are not found (system headers, or ones behind a macro) are left out,
+// as -MMD does; ones which don't exist yet but are targets (generated headers) are
+// kept, so they are made first.
+// Every #include is followed, whatever #if it is in, so this may find too much,
+// but never too little; the .d file replaces it after the first compile.
+//
+// A file's #include lines are kept in the build database with its digest, so a
+// file is only read again if its contents change.
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <llib/file.h>
+
+#include "includes.h"
+#include "db.h"
+#include "utils.h"
+
+// the #include lines in a file's text: '"' or '<' followed by the name
+static str_t *scan(str_t text) {
+    str_t **incs = seq_new_ref(str_t);
+    for (str_t p = text; *p; ) {
+        while (*p == ' ' || *p == '\t')
+            ++p;
+        if (*p == '#') {
+            ++p;
+            while (*p == ' ' || *p == '\t')
+                ++p;
+            if (strncmp(p,"include",7) == 0 || strncmp(p,"import",6) == 0) {
+                p += strcspn(p," \t\"<\n");
+                p += strspn(p," \t");
+                char close = *p == '"' ? '"' : *p == '<' ? '>' : 0;
+                if (close) {
+                    str_t end = strchr(p + 1,close);
+                    str_t eol = strchr(p,'\n');
+                    if (end && (! eol || end < eol)) {
+                        seq_add(incs,str_fmt("%c%.*s",*p,(int)(end - p - 1),p + 1));
+                    }
+                }
+            }
+        }
+        p = strchr(p,'\n');
+        if (! p)
+            break;
+        ++p;
+    }
+    return (str_t*)seq_array_ref(incs);
+}
+
+// a file's #include lines, from the build database if its contents are unchanged
+static str_t *file_includes(str_t path) {
+    uint64_t digest;
+    if (! db_is_open()) {
+        str_t text = file_read_all(path,true);
+        str_t *incs = text ? scan(text) : NULL;
+        unref(text);
+        return incs;
+    }
+    if (! file_digest(path,&digest))
+        return NULL;
+    DbFile *rec = db_file(path);
+    if (! rec->includes) {
+        str_t text = file_read_all(path,true);
+        if (! text)
+            return NULL;
+        rec->includes = scan(text);
+        unref(text);
+        db_file_save(rec);
+    }
+    return rec->includes;
+}
+
+static bool found(str_t path) {
+    return file_stat(path)->exists || target_from_file(path) != NULL;
+}
+
+// 'dir/../x' is 'x', and 'dir/./x' is 'dir/x'. Otherwise headers which include each
+// other as '../inc/b.h' would be found again and again under longer and longer names.
+static str_t normalise(str_t path) {
+    if (! strstr(path,"./"))
+        return path;
+    char **parts = str_split(path,"/");
+    str_t **keep = seq_new(str_t);
+    for (char **p = parts; *p; p++) {
+        int n = array_len(*keep);
+        if (str_eq(*p,"."))
+            continue;
+        if (str_eq(*p,"..") && n > 0 && ! str_eq((*keep)[n-1],"..")) {
+            array_len(*keep) = n - 1;
+            continue;
+        }
+        seq_add(keep,*p);
+    }
+    str_t *names = seq_array_ref(keep);
+    str_t joined = str_concat((char**)names,"/");
+    str_t res = *path == '/' ? str_fmt("/%s",joined) : str_new(*joined ? joined : ".");
+    dispose(parts,names,joined);
+    unref(path);
+    return res;
+}
+
+static str_t in_dir(str_t dir, str_t name) {
+    return normalise(*dir ? str_fmt("%s/%s",dir,name) : str_new(name));
+}
+
+// where the compiler would find this #include, or NULL if it is not ours.
+// "foo.h" is looked for next to the file, then in the -iquote directories (marked
+// with a '"') and then with <foo.h> in the others.
+static str_t resolve(str_t inc, str_t dir, str_t *incdirs) {
+    str_t name = inc + 1;
+    if (*name == '/')
+        return found(name) ? str_new(name) : NULL;
+    int n = incdirs ? array_len(incdirs) : 0;
+    if (*inc == '"') {
+        str_t path = in_dir(dir,name);
+        if (found(path))
+            return path;
+        unref(path);
+        FOR(i,n) {
+            if (*incdirs[i] != '"')
+                continue;
+            path = in_dir(incdirs[i] + 1,name);
+            if (found(path))
+                return path;
+            unref(path);
+        }
+    }
+    FOR(i,n) {
+        if (*incdirs[i] == '"')
+            continue;
+        str_t path = in_dir(incdirs[i],name);
+        if (found(path))
+            return path;
+        unref(path);
+    }
+    return NULL;
+}
+
+// the file, and all the files it includes (however indirectly) which can be found
+// in its directory or the include directories
+str_t *include_scan(str_t file, str_t *incdirs) {
+    str_t **deps = seq_new(str_t);
+    StrHash *seen = strhash_new(64);
+    seq_add(deps,file);
+    strhash_put(seen,file,(char*)file);
+    for (int i = 0; i < array_len(*deps); i++) {
+        str_t path = (*deps)[i];
+        str_t *incs = file_includes(path);
+        if (! incs)
+            continue;
+        str_t slash = strrchr(path,'/');
+        str_t dir = slash ? str_fmt("%.*s",(int)(slash - path),path) : "";
+        FOR(j,array_len(incs)) {
+            str_t dep = resolve(incs[j],dir,incdirs);
+            if (dep && ! strhash_get(seen,dep)) {
+                strhash_put(seen,dep,(char*)dep);
+                seq_add(deps,dep);
+            }
+        }
+        if (slash) {
+            unref(dir);
+        }
+    }
+    unref(seen);
+    return (str_t*)seq_array_ref(deps);
+}
@@ -0,0 +1,968 @@
+/*
+* shmake - a shell-based build tool
+* Copyright (c) 2015, Steve Donovan
+* BSD licence
+*/
+
+// Jobs are shell commands running as child processes. Unlike system(),
+// starting a job does not wait for it to finish, so that up to `jobs_max()`
+// commands may be running at once. Most commands (like compiling and linking)
+// are just words, and are started directly with posix_spawn; only those which
+// use the shell's syntax or builtins need /bin/sh.
+//
+// A job's output (stdout and stderr) is captured through pipes while it runs,
+// and handed back when it finishes, so that the output of jobs running at
+// the same time is never mixed up. The pipes are read as part of waiting
+// for jobs, with poll, so a job is never held up by a full pipe.
+//
+// We speak the GNU make jobserver protocol, so that nested builds share one
+// budget of jobs. The jobserver is a pipe (or named fifo) holding one token
+// byte per job slot; every job except the first needs a token, which is
+// written back when the job finishes. If MAKEFLAGS contains --jobserver-auth,
+// we are a client of an outer make or shmake; otherwise with -j N we become the
+// server, and anything we run (shmake, make, gcc -flto=jobserver) can join in.
+//
+// On Linux, a free slot is not enough: a job also has to fit in the memory we have.
+// Each job comes with an estimate of its peak memory (what it needed last time),
+// and we don't start it while the system is already stalling for memory, or if
+// the running jobs and it would need more than was available. Should the kernel
+// kill a job for lack of memory anyway, `jobs_fewer` lowers the number we run.
+//
+// A job runs here, or with $SHMAKE_WORKER, in a 'shmake --worker' process (see worker.c).
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+
+#include "jobs.h"
+#include "worker.h"
+
+// a client never runs more than this many jobs itself; the jobserver decides
+#define MAX_CLIENT_JOBS 256
+
+typedef struct Job_ {
+    pid_t pid; // -1 while a worker runs it
+    void *data;
+    int token; // -1 if this job is using our implicit slot
+    int fds[2]; // reading its stdout and stderr
+    JobText text[2];
+    int64_t memory; // what we expect it to need (KiB)
+    int64_t oom_kills; // how many processes the kernel had killed for memory when it started
+    int64_t over_max; // how many times its cgroup had gone over job-memory-max
+    str_t cgroup; // its own cgroup, if jobs have a memory limit
+    str_t cmd;
+    int sock; // the connection to the worker running this job, or -1
+    JobText reply; // what the worker has sent back so far
+} Job;
+
+// what the last job to finish wrote
+static JobText s_last[2];
+
+static Job *s_jobs;
+static int s_max = 1;
+static int s_limit = 1; // can be less than s_max if we run short of memory
+static int s_running;
+
+// jobserver state. We read tokens through our own non-blocking descriptor
+// so that we never hang in read() while children are finishing.
+static int s_js_read = -1, s_js_write = -1;
+static int s_js_poll = -1;
+static bool s_js_client;
+static int s_token = -1; // a token we have acquired but not yet used
+
+// SIGCHLD writes to this pipe, so that we can poll for children and tokens together
+static int s_child_pipe[2] = {-1,-1};
+
+static void on_child(int sig) {
+    int saved = errno;
+    if (write(s_child_pipe[1],"",1) < 0) {
+        // pipe is full, which is fine; somebody will read it
+    }
+    errno = saved;
+}
+
+static void close_on_exec(int fd) {
+    fcntl(fd,F_SETFD,fcntl(fd,F_GETFD) | FD_CLOEXEC);
+}
+
+static void non_blocking(int fd) {
+    fcntl(fd,F_SETFL,fcntl(fd,F_GETFL) | O_NONBLOCK);
+}
+
+static void jobs_init_signals() {
+    if (s_child_pipe[0] != -1)
+        return;
+    if (pipe(s_child_pipe) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    FOR(i,2) {
+        close_on_exec(s_child_pipe[i]);
+        non_blocking(s_child_pipe[i]);
+    }
+    struct sigaction sa;
+    memset(&sa,0,sizeof(sa));
+    sa.sa_handler = on_child;
+    sa.sa_flags = SA_NOCLDSTOP | SA_RESTART;
+    sigaction(SIGCHLD,&sa,NULL);
+    atexit(jobs_release);
+}
+
+// a private non-blocking descriptor on the same pipe; on Linux opening
+// /proc/self/fd gives us a new open file description. Otherwise we must make do.
+static int js_private_fd(int fd) {
+    int res = open(str_fmt("/proc/self/fd/%d",fd),O_RDONLY | O_NONBLOCK);
+    if (res == -1) {
+        res = dup(fd);
+    }
+    close_on_exec(res);
+    return res;
+}
+
+// what a word of MAKEFLAGS says about the jobserver, if anything
+static str_t js_auth(str_t word) {
+    if (str_starts_with(word,"--jobserver-auth="))
+        return word + strlen("--jobserver-auth=");
+    if (str_starts_with(word,"--jobserver-fds="))
+        return word + strlen("--jobserver-fds=");
+    return NULL;
+}
+
+// look for a jobserver in MAKEFLAGS: either --jobserver-auth=R,W (pipe),
+// --jobserver-auth=fifo:PATH or the older --jobserver-fds=R,W.
+bool jobs_client() {
+    if (s_js_client)
+        return true;
+    str_t flags = getenv("MAKEFLAGS");
+    if (! flags)
+        return false;
+    char **words = str_split(flags," ");
+    str_t auth = NULL;
+    for (char **w = words; *w; w++) {
+        if (js_auth(*w)) {
+            auth = js_auth(*w);
+        }
+    }
+    if (! auth)
+        return false;
+    if (str_starts_with(auth,"fifo:")) {
+        int fd = open(auth + 5,O_RDWR);
+        if (fd == -1) {
+            fprintf(stderr,"shmake: cannot open jobserver %s\n",auth + 5);
+            return false;
+        }
+        close_on_exec(fd);
+        s_js_read = s_js_write = fd;
+        s_js_poll = open(auth + 5,O_RDONLY | O_NONBLOCK);
+        close_on_exec(s_js_poll);
+    } else {
+        int r, w;
+        if (sscanf(auth,"%d,%d",&r,&w) != 2)
+            return false;
+        // the outer make may not have passed the descriptors on to us
+        if (fcntl(r,F_GETFD) == -1 || fcntl(w,F_GETFD) == -1) {
+            fprintf(stderr,"shmake: jobserver unavailable, running one job at a time\n");
+            return false;
+        }
+        s_js_read = r;
+        s_js_write = w;
+        s_js_poll = js_private_fd(r);
+    }
+    s_js_client = true;
+    jobs_init_signals();
+    return true;
+}
+
+// be the jobserver for anything we run: a pipe containing n-1 tokens
+static void jobs_serve(int n) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return;
+    }
+    s_js_read = fds[0];
+    s_js_write = fds[1];
+    for (int i = 1; i < n; i++) {
+        if (write(s_js_write,"+",1) != 1) {
+            perror("jobserver");
+            break;
+        }
+    }
+    s_js_poll = js_private_fd(s_js_read);
+    setenv("MAKEFLAGS",str_fmt("-j%d --jobserver-auth=%d,%d",n,s_js_read,s_js_write),true);
+    jobs_init_signals();
+}
+
+// An explicit count means we have nothing to do with a jobserver we were given,
+// and neither does anything we run: as GNU make does, we close its pipe and take
+// it (and its -j) out of MAKEFLAGS. (Descriptors which are not pipes are not the jobserver's;
+// the outer make did not pass them on, and the numbers are now used for something else.)
+static void jobs_leave_inherited() {
+    if (s_js_client) {
+        s_js_client = false;
+        close(s_js_poll);
+        close(s_js_read);
+        if (s_js_write != s_js_read)
+            close(s_js_write);
+        s_js_read = s_js_write = s_js_poll = -1;
+    }
+    str_t flags = getenv("MAKEFLAGS");
+    if (! flags)
+        return;
+    char **words = str_split(flags," ");
+    char **rest = strbuf_new();
+    bool found = false;
+    for (char **w = words; *w; w++) {
+        str_t auth = js_auth(*w);
+        if (str_starts_with(*w,"-j")) { // its count goes with it
+            continue;
+        }
+        if (! auth) {
+            strbuf_addsp(rest,*w);
+            continue;
+        }
+        found = true;
+        int fds[2];
+        if (sscanf(auth,"%d,%d",&fds[0],&fds[1]) == 2) {
+            FOR(i,2) {
+                struct stat st;
+                if (fstat(fds[i],&st) == 0 && S_ISFIFO(st.st_mode))
+                    close(fds[i]);
+            }
+        }
+    }
+    str_t others = strbuf_tostring(rest);
+    if (found) {
+        setenv("MAKEFLAGS",others,true);
+    }
+    dispose(words,others);
+}
+
+// The number of jobs we may run at once. Zero means 'not specified', which makes
+// us a client of any outer jobserver; an explicit count overrides it, as with GNU make.
+void jobs_set_max(int n) {
+    if (n == 0 && s_js_client) {
+        n = MAX_CLIENT_JOBS;
+    } else {
+        if (n < 1)
+            n = 1;
+        if (s_js_read == -1 || s_js_client) {
+            jobs_leave_inherited();
+        }
+        if (n > 1 && s_js_read == -1) {
+            jobs_serve(n);
+        }
+    }
+    s_max = s_limit = n;
+    s_jobs = array_new(Job,n);
+    memset(s_jobs,0,n*sizeof(Job));
+    FOR(i,n) {
+        s_jobs[i].sock = -1;
+    }
+}
+
+int jobs_max() {
+    return s_max;
+}
+
+int jobs_running() {
+    return s_running;
+}
+
+static bool token_acquire() {
+    char c;
+    if (s_token != -1)
+        return true;
+    if (read(s_js_poll,&c,1) == 1) {
+        s_token = (unsigned char)c;
+        return true;
+    }
+    return false;
+}
+
+static void token_release(int token) {
+    char c = (char)token;
+    while (write(s_js_write,&c,1) == -1 && errno == EINTR)
+        ;
+}
+
+// give back a token we have acquired but not used
+void jobs_release() {
+    if (s_token != -1) {
+        token_release(s_token);
+        s_token = -1;
+    }
+}
+
+// may we start another job now? The first job is free; others need a jobserver token.
+bool jobs_free() {
+    if (s_running >= s_limit)
+        return false;
+    if (s_running == 0 || s_js_poll == -1)
+        return true;
+    return token_acquire();
+}
+
+// a job was killed for lack of memory, so run fewer at once. Returns false if
+// we were already running just one.
+bool jobs_fewer() {
+    if (s_limit == 1)
+        return false;
+    s_limit /= 2;
+    return true;
+}
+
+int jobs_limit() {
+    return s_limit;
+}
+
+//////// Memory ////////
+
+// don't start jobs if tasks were stalled waiting for memory more than this
+// percentage of the last ten seconds (the 'some avg10' of /proc/pressure/memory)
+#define MEMORY_PRESSURE_MAX 10.0
+// and leave this much (KiB) for everything else
+#define MEMORY_RESERVE (256*1024)
+
+static bool s_memory_aware = true;
+static int64_t s_budget = -1; // memory available when none of our jobs were running
+static int64_t s_committed; // what the running jobs are expected to need
+
+void jobs_memory_aware(bool on) {
+    s_memory_aware = on;
+}
+
+// the number after `key` in a file of 'key value' lines, like /proc/meminfo, or -1
+static int64_t read_field(str_t path, str_t key) {
+    FILE *in = fopen(path,"r");
+    if (! in)
+        return -1;
+    char line[256], name[64];
+    long long value = -1, v;
+    while (fgets(line,sizeof(line),in)) {
+        if (sscanf(line,"%63s %lld",name,&v) == 2 && str_eq(name,key)) {
+            value = v;
+            break;
+        }
+    }
+    fclose(in);
+    return value;
+}
+
+static int64_t memory_available() {
+    return read_field("/proc/meminfo","MemAvailable:");
+}
+
+static double memory_pressure() {
+    FILE *in = fopen("/proc/pressure/memory","r");
+    double avg10 = 0;
+    if (in) {
+        if (fscanf(in,"some avg10=%lf",&avg10) != 1)
+            avg10 = 0;
+        fclose(in);
+    }
+    return avg10;
+}
+
+// how many processes the kernel has killed for lack of memory; within our cgroup if given
+static int64_t oom_kills(str_t cgroup) {
+    if (cgroup)
+        return read_field(str_fmt("%s/memory.events",cgroup),"oom_kill");
+    return read_field("/proc/vmstat","oom_kill");
+}
+
+// can we start a job which will need this much memory (KiB; zero if we don't know)?
+// The first job can always start, so the build always gets done.
+bool jobs_memory_free(int64_t need) {
+    if (! s_memory_aware)
+        return true;
+    if (s_running == 0) {
+        s_budget = memory_available();
+        return true;
+    }
+    if (s_budget < 0) // not Linux, or no /proc
+        return true;
+    if (memory_pressure() > MEMORY_PRESSURE_MAX)
+        return false;
+    // the running jobs may not have reached their peak yet, so count what they will need
+    int64_t avail = memory_available();
+    if (avail >= 0 && avail - need < MEMORY_RESERVE)
+        return false;
+    return s_committed + need <= s_budget - MEMORY_RESERVE;
+}
+
+// 'S job-memory-max SIZE' puts each job in a cgroup (v2) of its own, which the kernel
+// will not let use more than SIZE; so a runaway job is killed, rather than the machine
+// grinding to a halt. Our own cgroup must be delegated to us (e.g. 'systemd-run --user
+// --scope'), and we move ourselves into a leaf beside the jobs', since only a cgroup
+// without processes can share out its memory.
+static str_t s_cgroup_base;
+static int64_t s_job_memory_max;
+
+static bool write_file(str_t path, str_t text) {
+    int fd = open(path,O_WRONLY);
+    if (fd == -1)
+        return false;
+    bool ok = write(fd,text,strlen(text)) == (ssize_t)strlen(text);
+    close(fd);
+    return ok;
+}
+
+// where our cgroup is: the cgroup2 mount, and our path within it
+static str_t cgroup_dir() {
+    char line[1024];
+    str_t mount = NULL, path = NULL;
+    FILE *in = fopen("/proc/self/cgroup","r");
+    if (! in)
+        return NULL;
+    while (fgets(line,sizeof(line),in)) {
+        if (str_starts_with(line,"0::")) {
+            line[strcspn(line,"\n")] = '\0';
+            path = str_new(line + 3);
+        }
+    }
+    fclose(in);
+    in = fopen("/proc/self/mountinfo","r");
+    if (! in)
+        return NULL;
+    while (fgets(line,sizeof(line),in)) {
+        char mp[512], fs[64];
+        // ID PARENT MAJ:MIN ROOT MOUNT-POINT OPTIONS... - FSTYPE ...
+        char *dash = strstr(line," - ");
+        if (dash && sscanf(line,"%*s %*s %*s %*s %511s",mp) == 1 && sscanf(dash + 3,"%63s",fs) == 1
+                && str_eq(fs,"cgroup2")) {
+            mount = str_new(mp);
+            break;
+        }
+    }
+    fclose(in);
+    if (! mount || ! path)
+        return NULL;
+    return str_fmt("%s%s",mount,str_eq(path,"/") ? "" : path);
+}
+
+static void jobs_cgroup_cleanup() {
+    FOR(i,s_max) {
+        if (s_jobs[i].cgroup)
+            rmdir(s_jobs[i].cgroup);
+    }
+}
+
+bool jobs_set_memory_max(int64_t bytes) {
+    str_t base = cgroup_dir();
+    str_t why = "no cgroup2 file system";
+    if (base) {
+        str_t self = str_fmt("%s/shmake",base);
+        why = "our cgroup is not delegated to us";
+        if ((mkdir(self,0755) == 0 || errno == EEXIST)
+                && write_file(str_fmt("%s/cgroup.procs",self),str_fmt("%d\n",getpid()))) {
+            if (write_file(str_fmt("%s/cgroup.subtree_control",base),"+memory")) {
+                s_cgroup_base = base;
+                s_job_memory_max = bytes;
+                atexit(jobs_cgroup_cleanup);
+                return true;
+            }
+            why = "cannot enable the memory controller";
+            write_file(str_fmt("%s/cgroup.procs",base),str_fmt("%d\n",getpid()));
+        }
+        rmdir(self);
+    }
+    fprintf(stderr,"shmake: ignoring job-memory-max: %s\n",why);
+    return false;
+}
+
+// the cgroup for the job in slot i, made the first time it is used
+static str_t job_cgroup(int i) {
+    if (! s_cgroup_base)
+        return NULL;
+    Job *J = &s_jobs[i];
+    if (! J->cgroup) {
+        str_t dir = str_fmt("%s/job-%d-%d",s_cgroup_base,getpid(),i);
+        if ((mkdir(dir,0755) != 0 && errno != EEXIST)
+                || ! write_file(str_fmt("%s/memory.max",dir),str_fmt("%lld\n",(long long)s_job_memory_max))) {
+            perror(dir);
+            return NULL;
+        }
+        J->cgroup = dir;
+    }
+    return J->cgroup;
+}
+
+extern char **environ;
+
+// these characters mean something to the shell (or might; '=' only in the first word)
+#define SHELL_CHARS "|&;<>()$`\\\"'*?[]#~{}!"
+
+static str_t shell_words[] = {
+    "cd",".",":","source","exec","eval","exit","export","set","unset","readonly","local",
+    "ulimit","umask","alias","trap","shift","wait","read","return","break","continue",
+    "times","type","hash","command","getopts",
+    "if","for","while","until","case",NULL
+};
+
+// the command's words, if it can be run without the shell
+static char **command_words(str_t cmd) {
+    if (strpbrk(cmd,SHELL_CHARS)) {
+        return NULL;
+    }
+    char **words = str_split(cmd," \t\n");
+    if (! words[0] || strchr(words[0],'=') || str_index((const char**)shell_words,words[0]) != -1) {
+        unref(words);
+        return NULL;
+    }
+    return words;
+}
+
+static pid_t spawn(str_t cmd, posix_spawn_file_actions_t *fa, str_t cgroup) {
+    pid_t pid = -1;
+    if (cgroup) {
+        // the shell joins the job's cgroup before it runs the command
+        str_t join = str_fmt("echo $$ > '%s/cgroup.procs' && eval \"$1\"",cgroup);
+        char *argv[] = {"sh","-c",(char*)join,"sh",(char*)cmd,NULL};
+        int err = posix_spawn(&pid,"/bin/sh",fa,NULL,argv,environ);
+        if (err != 0) {
+            errno = err;
+            return -1;
+        }
+        return pid;
+    }
+    char **words = command_words(cmd);
+    if (words) {
+        // if it can't be run, then the shell will say why
+        if (posix_spawnp(&pid,words[0],fa,NULL,words,environ) != 0) {
+            pid = -1;
+        }
+        unref(words);
+        if (pid != -1) {
+            return pid;
+        }
+    }
+    char *argv[] = {"sh","-c",(char*)cmd,NULL};
+    int err = posix_spawn(&pid,"/bin/sh",fa,NULL,argv,environ);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+// start the command here, capturing its output
+static pid_t local_start(Job *J, str_t cmd) {
+    // the child's exit is noticed along with its output
+    jobs_init_signals();
+    int pipes[2][2];
+    FOR(k,2) {
+        if (pipe(pipes[k]) != 0) {
+            perror("pipe");
+            return 0;
+        }
+        close_on_exec(pipes[k][0]);
+        close_on_exec(pipes[k][1]);
+        non_blocking(pipes[k][0]);
+    }
+    J->oom_kills = oom_kills(J->cgroup);
+    J->over_max = J->cgroup ? read_field(str_fmt("%s/memory.events",J->cgroup),"oom") : 0;
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa,pipes[0][1],1);
+    posix_spawn_file_actions_adddup2(&fa,pipes[1][1],2);
+    pid_t pid = spawn(cmd,&fa,J->cgroup);
+    posix_spawn_file_actions_destroy(&fa);
+    FOR(k,2) {
+        close(pipes[k][1]);
+    }
+    if (pid == -1) {
+        perror("posix_spawn");
+        FOR(k,2) {
+            close(pipes[k][0]);
+        }
+        return 0;
+    }
+    J->pid = pid;
+    FOR(k,2) {
+        J->fds[k] = pipes[k][0];
+    }
+    return pid;
+}
+
+//////// Workers ////////
+
+// With $SHMAKE_WORKER, each job is sent to the worker on a connection of its own,
+// which is closed when the reply comes. A worker process serves one connection and
+// then takes the next, so however many jobs we (and other shmakes) send, each is
+// run once a worker process is free. If the worker can't be reached, or goes away,
+// jobs run here as usual.
+static str_t s_worker;
+
+static int worker_connect(str_t path) {
+    struct sockaddr_un addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path,path);
+    int fd = socket(AF_UNIX,SOCK_STREAM,0);
+    if (fd == -1)
+        return -1;
+    if (connect(fd,(struct sockaddr*)&addr,sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    close_on_exec(fd);
+    return fd;
+}
+
+bool jobs_use_worker(str_t path) {
+    int fd = worker_connect(path);
+    if (fd == -1) {
+        fprintf(stderr,"shmake: no worker at %s, so running jobs here\n",path);
+        return false;
+    }
+    close(fd);
+    s_worker = str_new(path);
+    return true;
+}
+
+bool jobs_worker() {
+    return s_worker != NULL;
+}
+
+static void worker_lost() {
+    if (s_worker) {
+        fprintf(stderr,"shmake: lost the worker at %s, so running jobs here\n",s_worker);
+        s_worker = NULL;
+    }
+}
+
+// the command gets our environment, except for our jobserver (the worker does not
+// share it) and the worker itself: a shmake run by the command builds on the worker's
+// machine, and must not send its own jobs back to a pool which may be full.
+static bool worker_env(str_t var) {
+    return ! str_starts_with(var,"MAKEFLAGS=") && ! str_starts_with(var,"SHMAKE_WORKER=");
+}
+
+// send the command to the worker; false if we must run it ourselves
+static bool worker_start(Job *J, str_t cmd, JobInput *inputs) {
+    J->sock = worker_connect(s_worker);
+    if (J->sock == -1) {
+        worker_lost();
+        return false;
+    }
+    char cwd[4096];
+    JobText *f = &J->reply;
+    frame_start(f);
+    frame_add_str(f,WORKER_PROTOCOL);
+    frame_add_str(f,getcwd(cwd,sizeof(cwd)) ? cwd : ".");
+    frame_add_str(f,cmd);
+    int nenv = 0;
+    for (char **e = environ; *e; e++) {
+        if (worker_env(*e))
+            ++nenv;
+    }
+    frame_add_int(f,nenv);
+    for (char **e = environ; *e; e++) {
+        if (worker_env(*e))
+            frame_add_str(f,*e);
+    }
+    int n = inputs ? array_len(inputs) : 0;
+    frame_add_int(f,n);
+    FOR(i,n) {
+        frame_add_str(f,inputs[i].path);
+        frame_add_int(f,(int64_t)inputs[i].digest);
+    }
+    bool ok = frame_send(J->sock,f);
+    f->len = 0;
+    if (! ok) {
+        close(J->sock);
+        J->sock = -1;
+        worker_lost();
+        return false;
+    }
+    J->pid = -1;
+    return true;
+}
+
+// run a command using the shell, associating some data with it which we get back
+// from job_wait, and what we expect it to need at its peak (KiB). A worker is
+// also sent the files the command reads, with their digests, so it can check
+// it sees the same ones; `inputs` may be NULL if we have no worker.
+// Returns the process id (-1 for a worker), or zero if the process could not be created.
+int job_start(str_t cmd, void *data, int64_t memory, JobInput *inputs) {
+    if (! s_jobs) {
+        jobs_set_max(s_max);
+    }
+    int slot = 0;
+    while (s_jobs[slot].pid != 0)
+        ++slot;
+    Job *J = &s_jobs[slot];
+    J->cgroup = job_cgroup(slot);
+    FOR(k,2) {
+        J->fds[k] = -1;
+        J->text[k].len = 0;
+    }
+    if (! (s_worker && worker_start(J,cmd,inputs)) && ! local_start(J,cmd)) {
+        return 0;
+    }
+    unref(J->cmd);
+    J->cmd = str_ref((char*)cmd);
+    J->data = data;
+    J->token = -1;
+    J->memory = memory;
+    if (s_running > 0) {
+        J->token = s_token;
+        s_token = -1;
+    }
+    s_committed += memory;
+    // the first job uses our implicit slot, so we don't need to keep a token
+    if (s_running == 0) {
+        jobs_release();
+    }
+    ++s_running;
+    return J->pid;
+}
+
+static void usage_from(JobUsage *usage, struct rusage *ru, Job *J, int st) {
+    if (! usage)
+        return;
+    // Without a cgroup of its own we only know that the kernel killed some process
+    // while it ran, so the job must also have been killed (or its shell says a command
+    // was); otherwise a compile error at the wrong moment would be run again.
+    // But a job which went over job-memory-max by itself would only do so again.
+    int64_t kills = oom_kills(J->cgroup);
+    bool killed = (WIFSIGNALED(st) && WTERMSIG(st) == SIGKILL)
+        || (WIFEXITED(st) && WEXITSTATUS(st) == 128 + SIGKILL);
+    usage->oom = J->oom_kills >= 0 && kills > J->oom_kills && (J->cgroup || killed);
+    if (J->cgroup && read_field(str_fmt("%s/memory.events",J->cgroup),"oom") > J->over_max)
+        usage->oom = false;
+    usage->user = ru->ru_utime.tv_sec*1000000LL + ru->ru_utime.tv_usec;
+    usage->sys = ru->ru_stime.tv_sec*1000000LL + ru->ru_stime.tv_usec;
+#ifdef __APPLE__
+    usage->maxrss = ru->ru_maxrss/1024; // bytes, not KiB
+#else
+    usage->maxrss = ru->ru_maxrss;
+#endif
+    usage->nvcsw = ru->ru_nvcsw;
+    usage->nivcsw = ru->ru_nivcsw;
+}
+
+static void text_add(JobText *t, const char *buff, int n) {
+    if (t->len + n + 1 > t->cap) {
+        t->cap = 2*(t->len + n + 1);
+        t->data = realloc(t->data,t->cap);
+    }
+    memcpy(t->data + t->len,buff,n);
+    t->len += n;
+    t->data[t->len] = '\0';
+}
+
+// read whatever the job has written, closing its pipes at the end
+static void job_read(Job *J) {
+    char buff[16384];
+    if (J->pid == -1 && J->sock != -1) {
+        ssize_t n;
+        while ((n = recv(J->sock,buff,sizeof(buff),MSG_DONTWAIT)) > 0) {
+            text_add(&J->reply,buff,n);
+        }
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+            close(J->sock);
+            J->sock = -1;
+        }
+    }
+    FOR(k,2) {
+        if (J->fds[k] == -1)
+            continue;
+        ssize_t n;
+        while ((n = read(J->fds[k],buff,sizeof(buff))) > 0) {
+            text_add(&J->text[k],buff,n);
+        }
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+            close(J->fds[k]);
+            J->fds[k] = -1;
+        }
+    }
+}
+
+// the job has finished, so what it wrote is ours. (Anything it left running
+// in the background may write more, but we don't wait for that.)
+static void job_finish_output(Job *J, JobText *output) {
+    job_read(J);
+    FOR(k,2) {
+        if (J->fds[k] != -1) {
+            close(J->fds[k]);
+            J->fds[k] = -1;
+        }
+        JobText t = s_last[k];
+        s_last[k] = J->text[k];
+        J->text[k] = t;
+        text_add(&s_last[k],"",0); // it may have written nothing
+        if (output) {
+            output[k] = s_last[k];
+        } else {
+            fwrite(s_last[k].data,1,s_last[k].len,k == 0 ? stdout : stderr);
+        }
+    }
+}
+
+// the job's slot is free, and so is its token
+static void job_done(Job *J) {
+    J->pid = 0;
+    --s_running;
+    s_committed -= J->memory;
+    if (J->token == -1) { // implicit slot is now free; pass it on
+        FOR(k,s_max) {
+            Job *K = &s_jobs[k];
+            if (K->pid != 0 && K->token != -1) {
+                J->token = K->token;
+                K->token = -1;
+                break;
+            }
+        }
+    }
+    if (J->token != -1) {
+        token_release(J->token);
+    }
+}
+
+static Job *job_reap(int *status, JobUsage *usage, JobText *output) {
+    int st;
+    pid_t pid;
+    struct rusage ru;
+    while ((pid = wait4(-1,&st,WNOHANG,&ru)) > 0) {
+        FOR(i,s_max) {
+            Job *J = &s_jobs[i];
+            if (J->pid == pid) {
+                job_done(J);
+                *status = WIFEXITED(st) ? WEXITSTATUS(st) : -1;
+                usage_from(usage,&ru,J,st);
+                job_finish_output(J,output);
+                return J;
+            }
+        }
+    }
+    if (pid == -1 && errno == ECHILD) {
+        bool local = false;
+        FOR(i,s_max) {
+            if (s_jobs[i].pid > 0)
+                local = true;
+        }
+        if (local) { // should not happen!
+            perror("wait4");
+            s_running = 0;
+        }
+    }
+    return NULL;
+}
+
+// a job the worker has finished. If the worker has gone away, its job is started again here.
+static Job *worker_reply(int *status, JobUsage *usage, JobText *output) {
+    FOR(i,s_max) {
+        Job *J = &s_jobs[i];
+        if (J->pid != -1)
+            continue;
+        if (frame_complete(&J->reply)) {
+            FrameReader r;
+            frame_reader(&r,&J->reply);
+            unref(frame_str(&r)); // "done"
+            *status = frame_int(&r);
+            JobUsage u;
+            u.user = frame_int(&r);
+            u.sys = frame_int(&r);
+            u.maxrss = frame_int(&r);
+            u.nvcsw = frame_int(&r);
+            u.nivcsw = frame_int(&r);
+            u.oom = frame_int(&r) != 0;
+            if (usage) {
+                *usage = u;
+            }
+            FOR(k,2) {
+                int len;
+                const char *data = frame_next(&r,&len);
+                text_add(&J->text[k],data ? data : "",data ? len : 0);
+            }
+            J->reply.len = 0;
+            if (J->sock != -1) {
+                close(J->sock);
+                J->sock = -1;
+            }
+            job_done(J);
+            job_finish_output(J,output);
+            return J;
+        }
+        if (J->sock == -1) {
+            worker_lost();
+            J->reply.len = 0;
+            J->pid = 0;
+            if (! local_start(J,J->cmd)) {
+                J->pid = -1;
+                job_done(J);
+                *status = -1;
+                text_add(&J->text[1],"shmake: cannot run the command\n",strlen("shmake: cannot run the command\n"));
+                if (usage) {
+                    memset(usage,0,sizeof(JobUsage));
+                }
+                job_finish_output(J,output);
+                return J;
+            }
+        }
+    }
+    return NULL;
+}
+
+// block until one of our jobs finishes, returning its data. The status
+// is the exit code of the command, or -1 if it was killed by a signal.
+// What the job cost goes into `usage`, and what it wrote to stdout and
+// stderr into `output` (which stays valid until the next call), if they're not NULL;
+// otherwise its output is written out now.
+// If `want_slot` is true, we also return (with NULL) as soon as the jobserver
+// has a token for us, so another job may start.
+void *job_wait(int *status, JobUsage *usage, JobText *output, bool want_slot) {
+    struct pollfd pfd[2 + 2*s_max];
+    while (s_running > 0) {
+        Job *J = job_reap(status,usage,output);
+        if (! J)
+            J = worker_reply(status,usage,output);
+        if (J)
+            return J->data;
+        if (want_slot && s_running < s_limit && token_acquire())
+            return NULL;
+        // a child finishing, a jobserver token, or some output
+        int n = 0;
+        pfd[n++] = (struct pollfd){s_child_pipe[0],POLLIN,0};
+        pfd[n++] = (struct pollfd){want_slot && s_running < s_limit ? s_js_poll : -1,POLLIN,0};
+        FOR(i,s_max) {
+            FOR(k,2) {
+                if (s_jobs[i].pid != 0 && s_jobs[i].fds[k] != -1) {
+                    pfd[n++] = (struct pollfd){s_jobs[i].fds[k],POLLIN,0};
+                }
+            }
+            if (s_jobs[i].pid == -1 && s_jobs[i].sock != -1) {
+                pfd[n++] = (struct pollfd){s_jobs[i].sock,POLLIN,0};
+            }
+        }
+        if (poll(pfd,n,-1) == -1 && errno != EINTR) {
+            perror("poll");
+        }
+        char buff[64];
+        while (read(s_child_pipe[0],buff,sizeof(buff)) > 0)
+            ;
+        FOR(i,s_max) {
+            if (s_jobs[i].pid != 0) {
+                job_read(&s_jobs[i]);
+            }
+        }
+    }
+    return NULL;
+}
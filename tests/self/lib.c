@@ -0,0 +1,1286 @@
+/* 
+* shmake - a shell-based build tool
+* Copyright (c) 2015, Steve Donovan
+* BSD licence
+*/
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include "shmake.h"
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <llib/file.h>
+#include <llib/template.h>
+#include <llib/json.h>
+#include <llib/array.h>
+
+#include "shmake.h"
+#include "utils.h"
+#include "jobs.h"
+#include "db.h"
+#include "cache.h"
+#include "trace.h"
+#include "includes.h"
+
+static int verbose_level;
+static bool testing;
+static bool quiet;
+static bool hashing;
+static bool keep_dfiles = true;
+static bool watching;
+static int s_restat = RESTAT_HEADERS;
+static int s_group_type;
+static int s_file_type;
+
+void shmake_flags(int v_level, bool test, bool silent) {
+    verbose_level = v_level;
+    testing = test;
+    quiet = silent;
+}
+
+// by default, targets are out of date if any prerequisite is newer. With hashing,
+// only if the contents of the prerequisites have changed since it was last built.
+void shmake_change_detection(bool hash) {
+    hashing = hash;
+}
+
+// the .d files are read into the build database after each compile; we may not
+// want to keep them around after that.
+void shmake_keep_dfiles(bool keep) {
+    keep_dfiles = keep;
+}
+
+// when watching, the graph stays in memory between builds, and a failed
+// build is not the end.
+void shmake_watching(bool watch) {
+    watching = watch;
+}
+
+// a generated file is often made again just the same (think code generators, or 'cp');
+// with 'restat' its dependents are then not rebuilt.
+void shmake_restat(int mode) {
+    s_restat = mode;
+}
+
+// File is a type representing a file
+// We wrap to give files a distinct type and to allow for generalization!
+static void File_dispose(File *f) {
+    unref(f->name);
+}
+
+File *File_new(str_t name) {
+    File *res = obj_new(File,File_dispose);
+    if (! s_file_type) {
+        s_file_type = obj_type_index(res);
+    }
+    res->name = str_ref(name);
+    return res;
+}
+
+// modification time in nanoseconds, or zero if the file does not exist.
+// Files are only stat'ed once, unless they have been rebuilt.
+int64_t File_time(File *f) {
+    return file_stat(f->name)->mtime;
+}
+
+// the digest of a file's contents. The build database remembers the digest together
+// with the file's time and size, and we only read the file if these have changed.
+bool file_digest(str_t path, uint64_t *digest) {
+    FileStat *st = file_stat(path);
+    if (! st->exists) {
+        return false;
+    }
+    DbFile *rec = db_file_new(path);
+    if (rec->mtime != st->mtime || rec->size != st->size) {
+        uint64_t old = rec->digest;
+        if (! hash_file(path,&rec->digest)) {
+            return false;
+        }
+        if (rec->digest != old) { // what it includes may have changed too
+            unref(rec->includes);
+            rec->includes = NULL;
+        }
+        rec->mtime = st->mtime;
+        rec->size = st->size;
+        db_file_save(rec);
+    }
+    *digest = rec->digest;
+    return true;
+}
+
+int File_remove(File *f) {
+    // no point in trying to remove what we know isn't there
+    if (! file_stat(f->name)->exists) {
+        return 0;
+    }
+    int res = unlink(f->name);
+    file_stat_forget(f->name);
+    if (verbose_level > 0) {
+        printf("removed %s\n",f->name);
+    }
+    if (res != 0) {
+        perror("unlink");
+        return res;
+    }    
+    return res;
+}
+
+// can always get the strings from an array of files (or targets)
+str_t* files_as_strings(File **files) {
+   str_t *strings = array_new_ref(str_t,array_len(files));
+    FOR(i, array_len(files)) {
+        strings[i] = ref(files[i]->name);
+    }
+    return strings;
+}
+
+/// The Target type inherits from File, so it may be safely downcast.
+// In addition, it has an array of things that this target depends on,
+// the _prerequisites_ (in Make terminology).
+// There is also an action, which is either a callback+data, or if the
+// callback is NULL, the data is interpreted as a shell command.
+// (see target_fire)
+
+static void Target_dispose(Target *T) {
+    unref(T->name);
+    unref(T->prereq);
+    unref(T->dependents);
+    // and data?
+}
+
+static int s_target_type;
+static Target *** s_targets;
+// targets, and the plain files they depend on, indexed by name
+static StrHash *s_target_index, *s_file_index;
+
+Target ** targets() {
+    if (! s_targets)
+        return NULL;
+    return *s_targets;
+}
+
+Target *target_from_file(str_t name) {
+    if (! s_target_index)
+        return NULL;
+    return (Target*)strhash_get(s_target_index,name);
+}
+
+// files which are not targets are shared between all targets which depend on them
+static File *file_from_name(str_t name) {
+    File *f = (File*)strhash_get(s_file_index,name);
+    if (! f) {
+        f = File_new(name);
+        strhash_put(s_file_index,f->name,f);
+    }
+    return ref(f);
+}
+
+void target_forall(TargetCallback f) {
+    FORA(*s_targets, f(_));
+}
+
+void target_set_command(Target *t, str_t cmd) {
+    t->data = cmd;
+}
+
+// Used to create a named target from a command, depending on the so-called
+// prerequisites. These are usually names of files or other targets, but may
+// already be File* or Target* objects.
+
+Target *target_new(str_t name, str_t *prereq, const void *data, ShmakeCallback callback) {    
+    Target *T = obj_new(Target,Target_dispose);
+    // this is llib hackery. Our pointers have associated types,
+    // so remember what the allocated type was for Target.
+    // Later we will do the horrible thing and distinguish between files and targets
+    // using this index
+    if (! s_target_type) {
+        s_target_type = obj_type_index(T);
+        s_targets = seq_new_ref(Target*);
+        s_target_index = strhash_new(1024);
+        s_file_index = strhash_new(1024);
+    }
+    Target *existing = target_from_file(name);
+    if (existing != NULL) { // a warning, perhaps?
+        return existing;
+    }
+    T->name = str_ref(name);
+    seq_add(s_targets,T);
+    strhash_put(s_target_index,T->name,T);
+    T->prereq = NULL;
+    target_set_prereq(T,prereq);
+    T->checked = false;
+    T->started = 0;
+    T->elapsed = -1;
+    T->restat = -1;
+    T->old_time = T->changed = 0;
+    T->pending = 0;
+    T->dependents = NULL;
+    T->callback = callback;
+    T->data = data;
+    T->message = NULL;
+    T->type = TARGET_PHONY;
+    return T;
+}
+
+// the prerequisites are given as names, or as File* or Target* objects.
+// They may be set again, e.g. when an object file has new dependencies.
+void target_set_prereq(Target *T, str_t *prereq) {
+    File **files = array_new_ref(File*,array_len(prereq));
+    FOR(i,array_len(prereq)) {
+        char *name = (char*)prereq[i];
+        File *f = NULL;
+        // Dodgy dynamic typing, a la llib
+        // prereq may contain strings (the default).
+        if (obj_refcount(name) == -1 || value_is_string(name)) {
+            // but we do check to see if the name refers to an existing target
+            f = (File*)target_from_file(name);
+            f = f ? ref(f) : file_from_name(name);
+        } else {
+            int type = obj_type_index(name);
+            // Target is a 'subclass' of File.
+            if (type == s_target_type || type == s_file_type) {
+                f = (File*)ref(name);
+            } else {
+                fprintf(stderr,"%d %p?\n",type,name);
+            }
+        }
+        files [i] = f;
+    }
+    unref(T->prereq);
+    T->prereq = files;
+}
+
+Target *target_first() {
+    return (*s_targets)[0];
+}
+
+// swop the target with the first one. It's usually the last, but a program
+// may come after a response file which it depends on.
+void target_push_to_front(Target *t) {
+    Target **targets = *s_targets;
+    int idx = array_len(targets)-1;
+    while (idx > 0 && targets[idx] != t) {
+        --idx;
+    }
+    targets[idx] = targets[0];
+    targets[0] = t;
+}
+
+static struct {
+    str_t key;
+    str_t value;
+}   std_map[] = {
+    {"TARGET",""},
+    {"INPUT",""},
+    {"DEPS",""},
+    {NULL,NULL}
+};
+
+// useful special case of a target, that has a command to be substituted using
+// values of the name 'TARGET' and 'INPUT' which is the first input file.
+// These variables must be inside @(), chosen to avoid conflicts with $ shell constructs.
+Target *target(str_t name, str_t *prereq, str_t cmd) {
+    Target *T = target_new(name,prereq,NULL,NULL);
+    if (cmd) {
+        if (strchr(cmd,'@') != NULL) { // it's a template
+            std_map[0].value = T->name;  // TARGET
+            if (T->prereq[0]) {
+                std_map[1].value = T->prereq[0]->name; // INPUT 
+                if (array_len(T->prereq)==0) { // DEPS
+                    std_map[2].value = std_map[1].value;
+                } else {                
+                    std_map[2].value = str_concat((char**)files_as_strings(T->prereq)," ");
+                }
+            }  else {
+                std_map[1].value = NULL;
+                std_map[2].value = NULL;
+            }
+            StrTempl *st = str_templ_new(cmd,"@()");
+            if (value_is_error(st))
+                return (Target*)st;
+            target_set_command(T,str_templ_subst(st, (char**)&std_map));
+        } else {
+            target_set_command(T,cmd);
+        }
+        T->type = TARGET_FILE;
+    }
+    return T;
+}
+
+// return all the files that our targets depends on (the 'prerequisites') as a space-separated
+// string.
+str_t target_depends_as_str(Target *T) {
+    return str_concat((char**)files_as_strings(T->prereq)," ");    
+}
+
+// unlike Make, don't echo the command unless -v, but compile/link targets have a message.
+static void target_announce(Target *T, char **out) {
+    char **buf = out ? out : strbuf_new();
+    if (verbose_level > 0) {
+        strbuf_addf(buf,"%s\n",(str_t)T->data);
+    } else
+    if (T->message && ! quiet) {
+        strbuf_addf(buf,"%s %s\n",T->message,T->name);
+    }
+    if (! out) {
+        fputs(*buf,stdout);
+        unref(buf);
+    }
+}
+
+// what the target's command needed at its peak the last time it ran (KiB), or zero
+static int64_t target_memory(Target *T) {
+    DbTarget *rec = db_target(T->name);
+    return rec ? rec->maxrss : 0;
+}
+
+static bool target_restats(Target *T) {
+    // when hashing, an unchanged output changes nothing anyway
+    if (T->type != TARGET_FILE || hashing || ! db_is_open()) {
+        return false;
+    }
+    if (T->restat != -1) {
+        return T->restat;
+    }
+    return s_restat == RESTAT_ALL
+        || (s_restat == RESTAT_HEADERS && str_eq_any(file_extension(T->name),".h",".hh",".hpp",".hxx",".inc"));
+}
+
+// remember what the output was before its command runs
+static void target_restat_before(Target *T) {
+    T->old_time = T->changed = 0;
+    if (target_restats(T) && file_digest(T->name,&T->old_digest)) {
+        T->old_time = File_time((File*)T);
+    }
+}
+
+// if the command made the output just as it was, the file is left alone (its time is
+// what the command gave it), but the build database says when its contents really
+// changed, and that is the time what depends on it is compared with.
+static void target_restat_after(Target *T) {
+    if (! T->old_time) {
+        return;
+    }
+    uint64_t digest;
+    file_stat_forget(T->name);
+    if (file_digest(T->name,&digest) && digest == T->old_digest) {
+        DbTarget *rec = db_target(T->name);
+        T->changed = rec && rec->changed && rec->stamp == T->old_time ? rec->changed : T->old_time;
+        if (verbose_level > 0) {
+            printf("%s is unchanged\n",T->name);
+        }
+    }
+    T->old_time = 0;
+}
+
+// the files a target's command reads, with their digests, for a worker to check
+static JobInput *target_inputs(Target *T) {
+    if (! jobs_worker() || ! T->prereq) {
+        return NULL;
+    }
+    JobInput *inputs = array_new(JobInput,array_len(T->prereq));
+    int n = 0;
+    FOR(i,array_len(T->prereq)) {
+        str_t path = T->prereq[i]->name;
+        if (file_digest(path,&inputs[n].digest)) {
+            inputs[n++].path = path;
+        }
+    }
+    array_len(inputs) = n;
+    return inputs;
+}
+
+// Calling the Action of a target. Can be an actual function, but usually is a command
+// string. If such a target has its _message_ field set, then we print that out rather
+// than the actual command (unless verbose).
+// Commands run in the background as jobs; returns true if we have to wait for one.
+// Then what we say about it comes out with its output, when it's finished.
+bool target_fire(Target *T) {
+    T->started = clock_us();
+    trace_start(T);
+    if (T->callback) {
+        T->callback(T->data);
+    } else
+    if (T->data && *(str_t)T->data) {
+        // then the target's data is a shell command line
+        str_t xcmd = (str_t)T->data;
+        if (T->type == TARGET_OBJ && ! testing && cache_is_open() && cache_fetch(T)) {
+            if (! quiet) {
+                printf("cached %s\n",T->name);
+            }
+            return false;
+        }
+        // -t for testing is useful if you just want to see what will happen with a build.
+        if (testing) {
+            target_announce(T,NULL);
+        } else {
+            if (T->type == TARGET_OBJ) {
+                // the compiler must make new files, not write into ones that may be
+                // shared with the object cache.
+                unlink(T->name);
+                file_stat_forget(T->name);
+                unlink(dfile_name(T->name));
+            }
+            target_restat_before(T);
+            JobInput *inputs = target_inputs(T);
+            int pid = job_start(xcmd,T,target_memory(T),inputs);
+            unref(inputs);
+            if (! pid) {
+                fprintf(stderr,"%s\n",xcmd);
+                exit(1);
+            }
+            trace_job(T,pid);
+            return true;
+        }
+    }
+    return false;
+}
+
+// a job has finished: say so, with whatever it wrote. Each stream is written at
+// once, so that it is not mixed up with the output of other builds.
+// A failed command is ALWAYS echoed, after its diagnostics.
+static void target_report(Target *T, int status, JobUsage *usage, JobText *output) {
+    char **out = strbuf_new();
+    target_announce(T,out);
+    strbuf_adds(out,output[0].data);
+    if (verbose_level > 0) {
+        strbuf_addf(out,"%s: %.2fs user, %.2fs system, %.1fM peak, %lld/%lld context switches\n",T->name,
+            usage->user/1.0e6,usage->sys/1.0e6,usage->maxrss/1024.0,(long long)usage->nvcsw,(long long)usage->nivcsw);
+    }
+    char **err = strbuf_new();
+    strbuf_adds(err,output[1].data);
+    if (status != 0) {
+        strbuf_addf(err,"%s\n",(str_t)T->data);
+    }
+    fwrite(*out,1,strlen(*out),stdout);
+    fflush(stdout);
+    fwrite(*err,1,strlen(*err),stderr);
+    dispose(out,err);
+}
+
+// the target's action has run, so what we knew about its file is out of date.
+// Compile and link commands (and generated files) only write their target, but any
+// other command may have changed anything.
+static void target_ran(Target *T) {
+    if (T->type == TARGET_FILE && ! T->callback) {
+        file_stat_forget_all();
+    } else {
+        file_stat_forget(T->name);
+    }
+}
+
+// a target's action has finished (or failed)
+static void target_stopped(Target *T, int status) {
+    T->elapsed = clock_us() - T->started;
+    trace_end(T,status);
+}
+
+// the signature of a target's command. If this changes (say because of new flags)
+// then the target must be rebuilt.
+static uint64_t target_signature(Target *T) {
+    if (T->callback || ! T->data || ! *(str_t)T->data) {
+        return 0;
+    }
+    return hash_str((str_t)T->data,0);
+}
+
+// an object's dependencies have changed, but it keeps any targets it was given
+// (like a precompiled header) which the compiler does not mention.
+static void target_refresh_prereq(Target *T, str_t *deps) {
+    str_t **names = seq_new(str_t);
+    seq_adda(names,deps,-1);
+    FOR(i,array_len(T->prereq)) {
+        File *f = T->prereq[i];
+        if (obj_type_index(f) == s_target_type && str_index(deps,f->name) == -1) {
+            seq_add(names,f->name);
+        }
+    }
+    target_set_prereq(T,(str_t*)seq_array_ref(names));
+}
+
+// a target has been successfully built, so remember how in the build database.
+// Object files have their dependencies (from the .d file) stored as well, and
+// if its command has just run, what that cost.
+static void target_built(Target *T, JobUsage *usage) {
+    if (! db_is_open() || T->type == TARGET_PHONY) {
+        return;
+    }
+    DbTarget *rec = db_target_new(T->name);
+    if (hashing && T->inputs) {
+        rec->inputs = T->inputs;
+    }
+    if (! T->callback && T->data) {
+        rec->command = str_ref((str_t)T->data);
+    }
+    rec->signature = target_signature(T);
+    // a restat target keeps the time its contents changed until its file changes again
+    int64_t stamp = File_time((File*)T);
+    if (T->changed || rec->stamp != stamp) {
+        rec->changed = T->changed;
+    }
+    rec->stamp = stamp;
+    if (usage) {
+        rec->user = usage->user;
+        rec->sys = usage->sys;
+        rec->maxrss = usage->maxrss;
+        rec->nvcsw = usage->nvcsw;
+        rec->nivcsw = usage->nivcsw;
+    }
+    if (T->type == TARGET_OBJ) {
+        str_t dfile = dfile_name(T->name);
+        str_t *deps = prereq_from_dfile(dfile);
+        if (deps) {
+            unref(rec->deps);
+            rec->deps = deps;
+            if (watching) { // the next build must know about any new headers
+                target_refresh_prereq(T,deps);
+            }
+            if (! keep_dfiles) {
+                unlink(dfile);
+            }
+        }
+        unref(dfile);
+    }
+    db_target_save(rec);
+}
+
+// the time of a file, or of a restat target when its contents last changed
+static int64_t content_time(File *f) {
+    int64_t t = File_time(f);
+    if (obj_type_index(f) == s_target_type && ((Target*)f)->type == TARGET_FILE) {
+        DbTarget *rec = db_target(f->name);
+        if (rec && rec->changed && rec->stamp == t && rec->changed < t) {
+            return rec->changed;
+        }
+    }
+    return t;
+}
+
+// is the target out-of-date with respect to its prerequisites?
+// This is only asked after all the prerequisite targets have been built.
+static bool target_out_of_date(Target *T) {
+    if (! T->prereq[0]) { // unconditional action
+        return true;
+    }
+    int64_t target_time = File_time((File*)T);
+    bool changed = false;
+    T->inputs = 0;
+    DbTarget *rec = db_target(T->name);
+    if (target_time != 0 && rec && rec->signature != target_signature(T)) {
+        if (verbose_level > 1) {
+            printf("! %s command changed\n",T->name);
+        }
+        return true;
+    }
+    if (hashing && target_time != 0) {
+        // the digest of every prerequisite's name and contents
+        uint64_t inputs = 0;
+        FOR(i,array_len(T->prereq)) {
+            File *f = T->prereq[i];
+            uint64_t digest;
+            if (! file_digest(f->name,&digest)) {
+                inputs = 0;
+                break;
+            }
+            inputs = hash_str(f->name,inputs);
+            inputs = hash_bytes(&digest,sizeof(digest),inputs);
+        }
+        T->inputs = inputs;
+        // a target built without hashing has no digest yet, so it goes by the times
+        if (inputs && rec && rec->inputs) {
+            if (verbose_level > 1) {
+                printf("! %s inputs %s\n",T->name,rec->inputs == inputs ? "unchanged" : "changed");
+            }
+            return rec->inputs != inputs;
+        }
+        // otherwise we have not seen this target before, so go by the times
+    }
+    // a list of File _or_ Target objects...
+    FOR(i,array_len(T->prereq)) {
+        File *f = T->prereq[i];
+        int64_t f_time = content_time(f);
+        if (verbose_level > 1) {
+            printf("! %s (%lld) depends on %s (%lld)\n",T->name,(long long)target_time,f->name,(long long)f_time);
+        }
+        // if we've been modified after the target, OR we don't yet exist, then fire!
+        if (f_time > target_time || f_time == 0) {
+            changed = true;
+        }
+    }
+    // remember its command (and digest) from now on
+    if (! changed && (! rec || (T->inputs && ! rec->inputs)) && ! testing) {
+        target_built(T,NULL);
+    }
+    return changed;
+}
+
+// Building is done with a scheduler rather than by recursion, so that independent
+// targets can be built at the same time. First we visit all the targets that
+// T depends on, in depth-first order, counting for each target how many
+// prerequisites are targets (its in-degree) and remembering who depends on whom.
+static void target_collect(Target *T, Target ***order) {
+    T->checked = true;
+    T->pending = 0;
+    T->elapsed = -1;
+    FOR(i,array_len(T->prereq)) {
+        File *f = T->prereq[i];
+        if (obj_type_index(f) == s_target_type) {
+            Target *P = (Target*)f;
+            if (! P->checked) {
+                target_collect(P,order);
+            } else
+            if (! P->dependents) { // still being visited; a cycle, so don't wait on it
+                continue;
+            }
+            ++T->pending;
+            seq_add(P->dependents,T);
+        }
+    }
+    T->dependents = seq_new(Target*);
+    T->order = array_len(*order);
+    seq_add(order,T);
+}
+
+// The ready queue is a heap ordered by depth-first position, so that with
+// one job targets are built in the same order as a recursive make would.
+static Target ***s_ready;
+static bool s_failed;
+
+static void ready_push(Target *T) {
+    seq_add(s_ready,T);
+    Target **h = *s_ready;
+    int i = array_len(h) - 1;
+    while (i > 0) {
+        int parent = (i - 1)/2;
+        if (h[parent]->order <= T->order)
+            break;
+        h[i] = h[parent];
+        i = parent;
+    }
+    h[i] = T;
+}
+
+static Target *ready_pop() {
+    Target **h = *s_ready;
+    int n = array_len(h) - 1;
+    Target *top = h[0], *last = h[n];
+    array_len(h) = n;
+    int i = 0;
+    for (;;) {
+        int child = 2*i + 1;
+        if (child >= n)
+            break;
+        if (child + 1 < n && h[child+1]->order < h[child]->order)
+            ++child;
+        if (last->order <= h[child]->order)
+            break;
+        h[i] = h[child];
+        i = child;
+    }
+    if (n > 0)
+        h[i] = last;
+    return top;
+}
+
+// a target is ready when all its prerequisite targets are finished.
+static void target_finished(Target *T) {
+    Target **deps = *T->dependents;
+    FOR(i,array_len(deps)) {
+        Target *D = deps[i];
+        if (--D->pending == 0) {
+            ready_push(D);
+        }
+    }
+}
+
+// the Special Sauce - checks if a target is out-of-date by checking against the times
+// of its prerequisites, after first bringing those prerequisites up to date.
+// Any target whose prerequisites are all finished may be fired, so with more than one
+// job we can keep several commands running at once.
+bool target_check(Target *T) {
+    if (T->checked) { // no point in rechecking targets...
+        return true;
+    }
+    Target ***order = seq_new(Target*);
+    target_collect(T,order);
+    Target **targets = (Target**)seq_array_ref(order);
+    s_ready = seq_new(Target*);
+    s_failed = false;
+    bool fired = false;
+    FOR(i,array_len(targets)) {
+        if (targets[i]->pending == 0) {
+            ready_push(targets[i]);
+        }
+    }
+    for (;;) {
+        // start as many of the ready targets as we can. We only ask if a target
+        // is out of date when it comes up, since earlier targets may have changed its inputs.
+        // If there isn't the memory for it, it waits until another job has finished.
+        // That is settled first, so a target which is held back is not checked (and hashed) twice.
+        bool memory_short = false;
+        while (! s_failed && array_len(*s_ready) > 0 && jobs_free()) {
+            Target *R = ready_pop();
+            if (! jobs_memory_free(target_memory(R))) {
+                ready_push(R);
+                memory_short = true;
+                break;
+            }
+            if (! target_out_of_date(R)) {
+                target_finished(R);
+                continue;
+            }
+            if (R == T) {
+                fired = true;
+            }
+            if (! target_fire(R)) {
+                target_stopped(R,0);
+                target_ran(R);
+                if (! testing) {
+                    target_built(R,NULL);
+                }
+                target_finished(R);
+            }
+        }
+        if (jobs_running() == 0) {
+            break;
+        }
+        // a token we did not use (say because there wasn't the memory) is not
+        // kept while we wait, since other makes sharing the jobserver may want it
+        jobs_release();
+        int status;
+        JobUsage usage;
+        JobText output[2];
+        bool want_slot = ! s_failed && array_len(*s_ready) > 0 && ! memory_short;
+        Target *D = (Target*)job_wait(&status,&usage,output,want_slot);
+        if (! D) { // a job slot has become free
+            continue;
+        }
+        target_stopped(D,status);
+        if (status != 0 && usage.oom && jobs_fewer()) {
+            // the kernel killed something for lack of memory, so try again with fewer jobs.
+            // It has not failed, so it is not reported as if it had.
+            fprintf(stderr,"shmake: %s ran out of memory; trying again with at most %d jobs\n",
+                D->name,jobs_limit());
+            ready_push(D);
+            continue;
+        }
+        target_report(D,status,&usage,output);
+        if (status != 0) {
+            s_failed = true;
+        } else {
+            target_ran(D);
+            target_restat_after(D);
+            if (D->type == TARGET_OBJ && cache_is_open()) {
+                cache_store(D);
+            }
+            target_built(D,&usage);
+            target_finished(D);
+        }
+    }
+    if (s_failed && ! watching) {
+        exit(1);
+    }
+    return fired;
+}
+
+// get ready to check the targets again, after these files have changed.
+// Only they are stat'ed again, so the targets which do not depend on them
+// are found to be up to date without going to the file system.
+void targets_reset(str_t *changed) {
+    FOR(i,array_len(changed)) {
+        file_stat_forget(changed[i]);
+    }
+    FOR(i,array_len(*s_targets)) {
+        Target *T = (*s_targets)[i];
+        T->checked = false;
+        T->pending = 0;
+        unref(T->dependents);
+        T->dependents = NULL;
+    }
+}
+
+// the targets which used the most memory first
+static int by_memory(const void *a, const void *b) {
+    const DbTarget *ra = *(DbTarget**)a, *rb = *(DbTarget**)b;
+    if (ra->maxrss != rb->maxrss)
+        return ra->maxrss > rb->maxrss ? -1 : 1;
+    return strcmp(ra->name,rb->name);
+}
+
+static double megs(int64_t kib) {
+    return kib/1024.0;
+}
+
+// what the targets' commands cost the last time they ran (so a build which has
+// nothing to do still gives an answer), with the `top` most memory-hungry.
+// When running N jobs, the N largest may well be running together.
+void targets_usage_report(int top) {
+    DbTarget ***recs = seq_new(DbTarget*);
+    int64_t user = 0, sys = 0, nvcsw = 0, nivcsw = 0;
+    FOR(i,array_len(*s_targets)) {
+        DbTarget *rec = db_target((*s_targets)[i]->name);
+        if (rec && rec->user + rec->sys > 0) {
+            seq_add(recs,rec);
+            user += rec->user;
+            sys += rec->sys;
+            nvcsw += rec->nvcsw;
+            nivcsw += rec->nivcsw;
+        }
+    }
+    DbTarget **all = (DbTarget**)seq_array_ref(recs);
+    int n = array_len(all);
+    printf("shmake: %d commands took %.2fs user, %.2fs system, %lld/%lld context switches\n",n,
+        user/1.0e6,sys/1.0e6,(long long)nvcsw,(long long)nivcsw);
+    if (n > 0) {
+        qsort(all,n,sizeof(DbTarget*),by_memory);
+        int jobs = jobs_max() < n ? jobs_max() : n;
+        int64_t peak = 0;
+        FOR(i,jobs) {
+            peak += all[i]->maxrss;
+        }
+        printf("the %d largest (one per job) need %.1fM together\n",jobs,megs(peak));
+        printf("%9s %8s %8s %13s  %s\n","peak","user","system","switches","target");
+        FOR(i,n < top ? n : top) {
+            DbTarget *r = all[i];
+            str_t csw = str_fmt("%lld/%lld",(long long)r->nvcsw,(long long)r->nivcsw);
+            printf("%8.1fM %7.2fs %7.2fs %13s  %s\n",megs(r->maxrss),r->user/1.0e6,r->sys/1.0e6,csw,r->name);
+            unref(csw);
+        }
+    }
+    unref(all);
+}
+
+// the names of all the plain files that targets depend on
+str_t *target_sources() {
+    str_t **res = seq_new_ref(str_t);
+    FOR(i,s_file_index->size) {
+        if (s_file_index->keys[i]) {
+            seq_add(res,ref(s_file_index->keys[i]));
+        }
+    }
+    return seq_array_ref(res);
+}
+
+int target_remove(Target *T) {
+    if (T->type == TARGET_PHONY) 
+        return 0;
+    File_remove((File*)T);
+    if (T->type == TARGET_OBJ) {
+        File dfile = {dfile_name(T->name)};
+        File_remove(&dfile);
+        File dwo = {file_replace_extension(T->name,".dwo")};
+        File_remove(&dwo);
+    }
+    if (T->type == TARGET_PROG) {
+        File rsp = {str_fmt("%s.rsp",T->name)};
+        File_remove(&rsp);
+    }
+    return 0;
+}
+
+// Groups are a useful abstraction; a distinct type which is a list of Target objects
+
+static void Group_dispose(Group *g) {
+    unref(g->cmd);
+    unref(g->targets);
+}
+
+static Group*** s_groups;
+static StrHash *s_group_index;
+static int n_group;
+
+// the first group with a given name wins. The index may still have a group under
+// a name it had before being renamed, so check that it is still called that.
+static void group_index(Group *G) {
+    if (! G->name)
+        return;
+    Group *other = (Group*)strhash_get(s_group_index,G->name);
+    if (! other || ! str_eq(other->name,G->name)) {
+        strhash_put(s_group_index,G->name,G);
+    }
+}
+
+Group *group_new(str_t cmd, Target **targets) {
+    Group *G = obj_new(Group,Group_dispose);
+    if (! s_group_type) {
+        s_group_type = obj_type_index(G);
+        s_groups = seq_new_ref(Group*);
+        s_group_index = strhash_new(64);
+    }
+    G->cmd = str_ref(cmd);
+    G->targets = ref(targets);
+    G->name = str_fmt("*G%03d",++n_group);
+    seq_add(s_groups,G);
+    group_index(G);
+    return G;
+}
+
+// groups are usually named after the rule or program which made them
+void group_set_name(Group *G, str_t name) {
+    G->name = name;
+    group_index(G);
+}
+
+Group *group_by_name(str_t name) {
+    if (! s_groups)
+        return NULL;
+    Group *G = (Group*)strhash_get(s_group_index,name);
+    if (G && str_eq(G->name,name)) {
+        return G;
+    }
+    return NULL;
+}
+
+str_t *group_expand_with_targets(str_t *prereq) {
+    // a target's prequisites may contain _rule names_, which contain target
+    // references. These must be expanded out.
+    str_t **ss = seq_new(str_t);
+    FOR(i,array_len(prereq)) {
+        str_t name = prereq[i];
+        Group *G = group_by_name(name);
+        if (G) {
+            str_t *tnames = files_as_strings((File**)G->targets);
+            seq_adda(ss,tnames,-1);
+        } else {
+            seq_add(ss,name);
+        }
+    }
+    //unref(prereq); refcount!
+    return seq_array_ref(ss);    
+}
+
+// the .d file written by the compiler for an object file or precompiled header:
+// 'foo.o' has 'foo.d', but 'foo.h.gch' has 'foo.h.d'.
+str_t dfile_name(str_t obj) {
+    if (str_ends_with(obj,".gch")) {
+        return str_fmt("%.*s.d",(int)strlen(obj) - 4,obj);
+    }
+    return file_replace_extension(obj,".d");
+}
+
+// read the .d generated by -MMD and extract the actual list of files
+// which our target obj is dependent on.
+// A .d file starts with TARGET COLON followed by all the files which TARGET
+// depends on. Backlashes need to be ignored.
+str_t* prereq_from_dfile (str_t dfile) {
+    char *contents = file_read_all (dfile, true);
+    if (! contents)
+        return NULL;
+    char *S = strchr(contents,':');
+    if (! S) // not a .d file AT ALL
+        return NULL;
+    ++S;
+    // replace '\\\\n' with '  '
+    for (char *P=S; *P; P++) {
+        if (*P=='\\' && *(P+1)=='\n') {
+            *P = ' ';
+            *(P+1) = ' ';
+        }
+    }
+    return (str_t*)str_split(S," ");    
+}
+
+// compiling a file (or precompiling a header) with a command.
+// What the result depended on last time it was built is in the build database,
+// but a .d file may be all we have if it was built before we had one.
+// If it has never been built, we scan the file for its includes ourselves.
+// An object using a precompiled header must also depend on it, since its .d file does not say so.
+static Target *compile_target(str_t cmd, str_t file, str_t obj, str_t pch, str_t *incdirs) {
+    str_t *reqs = NULL;
+    DbTarget *rec = db_target(obj);
+    if (rec && rec->deps) {
+        reqs = rec->deps;
+    } else {
+        int64_t start = trace_now();
+        str_t dfile = dfile_name(obj);
+        reqs = prereq_from_dfile(dfile);
+        if (reqs) {
+            trace_phase(str_fmt("read %s",dfile),start);
+        }
+    }
+    if (! reqs) {
+        int64_t start = trace_now();
+        reqs = include_scan(file,incdirs);
+        trace_phase(str_fmt("scan %s",file),start);
+    }
+    if (pch) {
+        str_t **rs = seq_new(str_t);
+        seq_adda(rs,reqs,-1);
+        seq_add(rs,pch);
+        reqs = seq_array_ref(rs);
+    }
+    Target *T = target_new(obj,reqs,str_fmt("%s %s -o %s",cmd,file,obj),NULL);
+    T->message = "compiling";
+    T->type = TARGET_OBJ;
+    return T;
+}
+
+// A unity build compiles files in chunks of about n at a time, each chunk being a generated
+// source which includes its files. A chunk ends after a file whose name hashes to a
+// multiple of n, so that adding or removing a file only changes the chunk it is in.
+// Chunks also end when they get too big, or the language changes.
+
+static int str_cmp(const void *a, const void *b) {
+    return strcmp(*(str_t*)a,*(str_t*)b);
+}
+
+static bool unity_chunk_ends(str_t file, str_t next, int n, int size) {
+    return ! next || hash_str(file,0) % n == 0 || size >= 2*n
+        || ! str_eq(file_extension(file),file_extension(next));
+}
+
+// Unity chunks go in a directory of their own (or the output directory), and when the
+// files change, the old chunks and their objects are left behind there. The first chunk
+// to be written in a directory removes them: 'unity_*' files which are not targets,
+// or the outputs of targets. The directories are marked once this has been done.
+static StrHash *s_unity_dirs;
+
+static void unity_prune(str_t dir, bool all) {
+    DIR *d = opendir(dir);
+    if (! d)
+        return;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (! str_starts_with(e->d_name,"unity_"))
+            continue;
+        str_t path = str_fmt("%s/%s",dir,e->d_name);
+        str_t obj = file_replace_extension(path,".o");
+        if (all || ! (target_from_file(path) || target_from_file(obj))) {
+            if (verbose_level > 0) {
+                printf("removing %s\n",path);
+            }
+            unlink(path);
+            file_stat_forget(path);
+        }
+        dispose(path,obj);
+    }
+    closedir(d);
+}
+
+// a generated file (the data is its path, contents and any unity directory) is written
+// when it comes up in the build, never with -t, and only if it has changed so that
+// its dependents are not rebuilt for nothing.
+static int generated_write(const void *data) {
+    str_t *file = (str_t*)data;
+    if (testing)
+        return 0;
+    if (file[2] && ! strhash_get(s_unity_dirs,file[2])) {
+        mkdir(file[2],0777);
+        file_stat_forget(file[2]);
+        unity_prune(file[2],false);
+        strhash_put(s_unity_dirs,file[2],(void*)file[2]);
+    }
+    file_write_changed(file[0],file[1]);
+    return 0;
+}
+
+static Target *generated_target(str_t path, str_t text, str_t unity_dir) {
+    str_t *data = array_new_ref(str_t,3);
+    data[0] = str_ref(path);
+    data[1] = text;
+    data[2] = unity_dir;
+    Target *T = target_new(path,(str_t*)array_new(str_t,0),data,generated_write);
+    T->type = TARGET_FILE;
+    return T;
+}
+
+// the generated source for a chunk, named after its first file.
+static Target *unity_source(str_t dir, str_t *chunk) {
+    str_t first = chunk[0];
+    str_t name = str_fmt("unity_%s_%06x%s",file_replace_extension(file_basename(first),""),
+        (unsigned)(hash_str(first,0) & 0xffffff),file_extension(first));
+    str_t path = str_fmt("%s/%s",dir,name); // the directory is made when the chunk is written
+    // the files are included by their full paths, which do not depend on where the chunk is
+    char cwd[4096];
+    if (! getcwd(cwd,sizeof(cwd))) {
+        strcpy(cwd,".");
+    }
+    str_t *lines = array_new_ref(str_t,array_len(chunk));
+    FOR(i,array_len(chunk)) {
+        str_t file = chunk[i];
+        while (str_starts_with(file,"./")) {
+            file += 2;
+        }
+        if (*file == '/') {
+            lines[i] = str_fmt("#include \"%s\"\n",file);
+        } else {
+            lines[i] = str_fmt("#include \"%s/%s\"\n",cwd,file);
+        }
+    }
+    Target *T = generated_target(path,str_concat((char**)lines,""),dir);
+    unref(lines);
+    return T;
+}
+
+// 'clean' removes all the chunks (even old ones), and the 'unity' directory if that is now empty
+void unity_clean() {
+    if (! s_unity_dirs)
+        return;
+    FOR(i,s_unity_dirs->size) {
+        str_t dir = s_unity_dirs->keys[i];
+        if (dir) {
+            unity_prune(dir,true);
+            if (str_eq(dir,"unity")) {
+                rmdir(dir);
+            }
+        }
+    }
+}
+
+// make targets for the chunks, returning the files which are to be compiled on their own
+static str_t *unity_build(Target ***targets, str_t *files, int n, str_t *separate, str_t dir, str_t cmd, str_t pch,
+    str_t *incdirs) {
+    if (! s_unity_dirs) {
+        s_unity_dirs = strhash_new(4);
+    }
+    dir = str_new(dir);
+    strhash_put(s_unity_dirs,dir,NULL);
+    str_t **rest = seq_new(str_t);
+    str_t **merge = seq_new(str_t);
+    FOR(i,array_len(files)) {
+        if (separate && str_index(separate,files[i]) != -1) {
+            seq_add(rest,files[i]);
+        } else {
+            seq_add(merge,files[i]);
+        }
+    }
+    str_t *sorted = seq_array_ref(merge);
+    qsort(sorted,array_len(sorted),sizeof(str_t),str_cmp);
+    str_t **chunk = seq_new(str_t);
+    FOR(i,array_len(sorted)) {
+        seq_add(chunk,sorted[i]);
+        if (! unity_chunk_ends(sorted[i],sorted[i+1],n,array_len(*chunk)))
+            continue;
+        str_t *members = seq_array_ref(chunk);
+        if (array_len(members) == 1) { // no point in a chunk of one
+            seq_add(rest,members[0]);
+        } else {
+            str_t src = unity_source(dir,members)->name;
+            seq_add(targets,compile_target(cmd,src,file_replace_extension(src,".o"),pch,incdirs));
+        }
+        chunk = seq_new(str_t);
+    }
+    unref(sorted);
+    return seq_array_ref(rest);
+}
+
+// where the compiler looks for includes: the -I list, and any -I, -iquote or -isystem
+// in the other flags (from 'S cflags' or needs). An -iquote directory is only for
+// '#include "foo.h"', so it is marked with a '"', as the #include lines are.
+static str_t *include_dirs(str_t cflags, str_t *incdirs) {
+    static str_t flags[] = {"-I","-iquote","-isystem",NULL};
+    str_t **dirs = seq_new_ref(str_t);
+    FOR(i,incdirs ? array_len(incdirs) : 0) {
+        seq_add(dirs,str_new(incdirs[i]));
+    }
+    char **words = str_split(cflags ? cflags : ""," \t");
+    for (char **w = words; *w; w++) {
+        for (str_t *f = flags; *f; f++) {
+            if (! str_starts_with(*w,*f))
+                continue;
+            str_t dir = *w + strlen(*f);
+            if (! *dir && w[1]) { // '-I dir'
+                dir = *++w;
+            }
+            if (*dir) {
+                seq_add(dirs,str_eq(*f,"-iquote") ? str_fmt("\"%s",dir) : str_new(dir));
+            }
+            break;
+        }
+    }
+    unref(words);
+    return (str_t*)seq_array_ref(dirs);
+}
+
+Group *compile_step (str_t compiler, str_t *files, str_t cflags, str_t *incdirs, str_t *defines, str_t odir, str_t pch,
+    int unity, str_t *separate) {
+    files = group_expand_with_targets(files);
+    
+    str_t cmd = str_fmt("%s -c -MMD %s%s%s",
+        compiler,cflags,flag_concat("-D",defines),flag_concat("-I",incdirs));
+    incdirs = include_dirs(cflags,incdirs);
+
+    // a precompiled header is built with exactly the same flags as the objects, into
+    // the output directory. The compiler uses 'odir/foo.h.gch' for '-include odir/foo.h'
+    // (which need not exist); with no output directory it goes next to the header.
+    str_t obj_cmd = cmd, gch = NULL;
+    if (pch && *pch) {
+        str_t header = odir && *odir ? join(odir,file_basename(pch)) : pch;
+        gch = str_fmt("%s.gch",header);
+        compile_target(cmd,pch,gch,NULL,incdirs);
+        obj_cmd = str_fmt("%s -include %s -Winvalid-pch",cmd,header);
+    }
+    
+    // unity chunks go in the output directory, or in 'unity' so that they don't match '*.c'
+    Target ***targets = seq_new_ref(Target*);
+    if (unity > 1) {
+        files = unity_build(targets,files,unity,separate,odir && *odir ? odir : "unity",obj_cmd,gch,incdirs);
+    }
+    FOR(i,array_len(files)) {
+        str_t file = files[i];
+        str_t obj = file_replace_extension(join(odir,file),".o");
+        seq_add(targets,compile_target(obj_cmd,file,obj,gch,incdirs));
+    }
+    return group_new(cmd, (Target**)seq_array_ref(targets));    
+}
+
+// a list of objects longer than this goes in a response file ('@file'), which the
+// compiler and ar read for themselves, so that a huge link does not hit the limit
+// on the size of a command line.
+#define RESPONSE_FILE_SIZE 32768
+
+Target *linker (str_t linker, str_t name, str_t *objs, str_t lflags, str_t *libdirs, str_t *libs, int kind) {
+    // build up list of prerequisites for our target.
+    // They may be GROUPS which are lists of targets
+    // Typically the results are object files but could also be library files referenced directly.
+    File ***deps = seq_new_ref(File*);
+    FOR(i, array_len(objs)) {
+        str_t file = objs[i];
+        if (file==NULL) // may happen when linking straight from groups...
+           continue;
+        Group *G = group_by_name(file);
+        if (G) {
+            seq_adda(deps, G->targets, -1);
+        } else {
+            seq_add(deps, (File*)file);
+        }        
+    }
+    void **pr = seq_array_ref(deps);
+    Target *T = target_new(name,(str_t*)pr,"",NULL);
+    str_t obj_files = target_depends_as_str(T);
+    if (strlen(obj_files) > RESPONSE_FILE_SIZE) {
+        // it is written when the link comes up, since it is a target the link depends on
+        Target *rsp = generated_target(str_fmt("%s.rsp",name),str_fmt("%s\n",obj_files),NULL);
+        obj_files = str_fmt("@%s",rsp->name);
+        // the command no longer changes with the objects, but the response file does
+        File ***prereq = seq_new_ref(File*);
+        seq_adda(prereq,T->prereq,-1);
+        seq_add(prereq,(File*)rsp);
+        target_set_prereq(T,(str_t*)seq_array_ref(prereq));
+    }
+
+    // these are plain commands, so they are run without the shell
+    str_t cmd;
+    if (kind == LINK_LIB) {
+        // 's' writes the index, like ranlib
+        cmd = str_fmt("ar rcs %s %s",name,obj_files);
+    } else
+    if (kind == LINK_THIN_LIB) {
+        // a thin archive just refers to the object files, and 's' writes its index.
+        // An ordinary archive cannot be made thin, so start afresh.
+        cmd = str_fmt("rm -f %s; ar rcsT %s %s",name,name,obj_files);
+    } else {
+        cmd = str_fmt("%s %s %s%s%s -o %s",
+            linker,obj_files,lflags,flag_concat("-L",libdirs),flag_concat("-l",libs),name);
+    }
+    T->type = TARGET_PROG;
+    T->message = "linking";
+    target_set_command(T,cmd);
+    return T;
+}
@@ -0,0 +1,103 @@
+#ifndef __SHMAKE_H
+#define __SHMAKE_H
+#include <llib/str.h>
+
+void shmake_flags(int v_level, bool test, bool silent);
+void shmake_change_detection(bool hash);
+void shmake_keep_dfiles(bool keep);
+void shmake_watching(bool watch);
+
+// which file targets are restat'ed: none, just headers (the default) or all of them
+enum RestatMode {RESTAT_NONE, RESTAT_HEADERS, RESTAT_ALL};
+void shmake_restat(int mode);
+
+typedef struct File_ {
+    str_t name;
+} File;
+
+File *File_new(str_t name);
+int64_t File_time(File *f);
+int File_remove(File *f);
+bool file_digest(str_t path, uint64_t *digest);
+
+str_t* files_as_strings(File **files);
+
+typedef int (*ShmakeCallback)(const void *);
+
+enum TargetType {TARGET_PHONY, TARGET_FILE, TARGET_OBJ, TARGET_PROG};
+
+typedef struct Target_ {
+    // File-like part - safe to cast Target* to File*
+    str_t name;
+    // we have _prerequistes_. If they change, we must update this target
+    File **prereq;
+    // don't need to check the same target twice
+    bool checked;
+    // when building, the number of target prerequisites not yet finished,
+    // our position in depth-first order (lowest goes first)
+    // and the targets which are waiting on us (a seq)
+    int pending;
+    int order;
+    struct Target_ ***dependents;
+    // when hashing, the digest of the prerequisites' contents
+    uint64_t inputs;
+    // when its action started, and how long it took (microseconds; -1 if it did not run)
+    int64_t started, elapsed;
+    // 'restat': if its command leaves the output as it was, what depends on it is not rebuilt (-1 means the default).
+    // Before the command, the output's time and digest; afterwards `changed` is when its
+    // contents last changed (ns), if that was before its file's time.
+    int restat;
+    int64_t old_time, changed;
+    uint64_t old_digest;
+    // we have an _action_.
+    ShmakeCallback callback; // if not NULL, call with data
+    const void *data; // otherwise data is a command string!
+    // may have a Special Message printed out when building this target in normal mode
+    str_t message;
+    enum TargetType type;
+} Target;
+
+typedef int (*TargetCallback)(Target *t);
+
+Target *target_from_file(str_t name);
+void target_forall(TargetCallback f);
+void target_set_command(Target *t, str_t cmd);
+Target *target_new(str_t name, str_t *prereq, const void *data, ShmakeCallback callback);
+void target_set_prereq(Target *T, str_t *prereq);
+Target *target_first();
+void target_push_to_front(Target *t);
+Target *target(str_t name, str_t *prereq, str_t cmd);
+
+bool target_fire(Target *T);
+
+bool target_check(Target *T);
+
+int target_remove(Target *T);
+void unity_clean();
+
+void targets_reset(str_t *changed);
+str_t *target_sources();
+void targets_usage_report(int top);
+
+Target ** targets();
+
+typedef struct Group_ {
+    str_t cmd;
+    Target **targets;
+    str_t name;
+} Group;
+
+Group *group_new(str_t cmd, Target **targets);
+void group_set_name(Group *G, str_t name);
+Group *group_by_name(str_t name);
+str_t *group_expand_with_targets(str_t *prereq);
+
+enum {LINK_EXE, LINK_SO, LINK_LIB, LINK_STATIC, LINK_THIN_LIB};
+
+str_t dfile_name(str_t obj);
+str_t* prereq_from_dfile (str_t dfile);
+Group *compile_step (str_t compiler, str_t *files, str_t cflags, str_t *incdirs, str_t *defines, str_t odir, str_t pch,
+    int unity, str_t *separate);
+Target *linker (str_t linker, str_t name, str_t *objs, str_t lflags, str_t *libdirs, str_t *libs, int kind); 
+
+#endif
@@ -0,0 +1,171 @@
+/*
+* shmake - a shell-based build tool
+* Copyright (c) 2015, Steve Donovan
+* BSD licence
+*/
+
+// '--trace FILE' writes what happened during the build as Chrome trace events,
+// which can be loaded into Perfetto (or chrome://tracing). Our own phases, like
+// running the shmakefile, are on the first track; each action runs on the
+// lowest free 'job' track, so gaps in the parallelism are easy to see.
+// Events are written as they finish, and the file is closed at exit.
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "utils.h"
+
+typedef struct Action_ {
+    Target *T;
+    int pid;
+    int64_t start;
+    int lane;
+} Action;
+
+#define TRACE_EPOCH "SHMAKE_TRACE_EPOCH"
+
+static FILE *s_out;
+static int64_t s_epoch;
+static int s_pid;
+static Action *s_actions; // the actions now running
+static int s_nactions;
+static bool *s_lanes; // which tracks are busy; the first is ours
+static int s_nlanes;
+
+static const char *type_names[] = {"phony","file","object","program"};
+
+// microseconds since the trace started
+int64_t trace_now() {
+    return clock_us() - s_epoch;
+}
+
+static void put_str(str_t s) {
+    fputc('"',s_out);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(s_out,"\\%c",c);
+        } else
+        if (c < 0x20) {
+            fprintf(s_out,"\\u%04x",c);
+        } else {
+            fputc(c,s_out);
+        }
+    }
+    fputc('"',s_out);
+}
+
+static void lane_name(int lane, str_t name) {
+    fprintf(s_out,",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",s_pid,lane);
+    put_str(name);
+    fprintf(s_out,"}}");
+}
+
+bool trace_open(str_t path) {
+    // after a restart with -w, we carry on with the same trace
+    str_t epoch = getenv(TRACE_EPOCH);
+    s_out = fopen(path,epoch ? "a" : "w");
+    if (! s_out) {
+        perror(path);
+        return false;
+    }
+    s_epoch = epoch ? atoll(epoch) : clock_us();
+    s_pid = getpid();
+    s_nlanes = 1;
+    s_lanes = calloc(1,sizeof(bool));
+    s_lanes[0] = true;
+    if (! epoch) {
+        fprintf(s_out,"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        fprintf(s_out,"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"shmake\"}}",s_pid);
+        lane_name(0,"shmake");
+    }
+    unsetenv(TRACE_EPOCH);
+    atexit(trace_close);
+    return true;
+}
+
+bool trace_is_open() {
+    return s_out != NULL;
+}
+
+// one of our own phases has finished
+void trace_phase(str_t name, int64_t start) {
+    if (! s_out)
+        return;
+    fprintf(s_out,",\n{\"name\":");
+    put_str(name);
+    fprintf(s_out,",\"cat\":\"shmake\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":0}",
+        (long long)start,(long long)(trace_now() - start),s_pid);
+}
+
+static Action *action_find(Target *T) {
+    FOR(i,s_nactions) {
+        if (s_actions[i].T == T)
+            return &s_actions[i];
+    }
+    return NULL;
+}
+
+// a target's action is starting
+void trace_start(Target *T) {
+    if (! s_out)
+        return;
+    int lane = 1;
+    while (lane < s_nlanes && s_lanes[lane])
+        ++lane;
+    if (lane == s_nlanes) {
+        s_lanes = realloc(s_lanes,++s_nlanes*sizeof(bool));
+        lane_name(lane,str_fmt("job %d",lane));
+    }
+    s_lanes[lane] = true;
+    s_actions = realloc(s_actions,++s_nactions*sizeof(Action));
+    Action *A = &s_actions[s_nactions-1];
+    A->T = T;
+    A->pid = 0;
+    A->start = trace_now();
+    A->lane = lane;
+}
+
+// ... and it is a process
+void trace_job(Target *T, int pid) {
+    Action *A = s_out ? action_find(T) : NULL;
+    if (A)
+        A->pid = pid;
+}
+
+// ... and it has finished
+void trace_end(Target *T, int status) {
+    Action *A = s_out ? action_find(T) : NULL;
+    if (! A)
+        return;
+    fprintf(s_out,",\n{\"name\":");
+    put_str(T->name);
+    fprintf(s_out,",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d,"
+        "\"args\":{\"type\":\"%s\",\"pid\":%d,\"status\":%d}}",
+        type_names[T->type],(long long)A->start,(long long)(trace_now() - A->start),s_pid,A->lane,
+        type_names[T->type],A->pid,status);
+    s_lanes[A->lane] = false;
+    *A = s_actions[--s_nactions];
+}
+
+// we are about to start again (same process, same trace), so leave it open-ended
+void trace_suspend() {
+    if (! s_out)
+        return;
+    fclose(s_out);
+    s_out = NULL;
+    char buff[32];
+    snprintf(buff,sizeof(buff),"%lld",(long long)s_epoch);
+    setenv(TRACE_EPOCH,buff,true);
+}
+
+void trace_close() {
+    if (! s_out)
+        return;
+    fprintf(s_out,"\n]}\n");
+    fclose(s_out);
+    s_out = NULL;
+}
@@ -0,0 +1,15 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+#include "shmake.h"
+
+bool trace_open(str_t path);
+bool trace_is_open();
+int64_t trace_now();
+void trace_phase(str_t name, int64_t start);
+void trace_start(Target *T);
+void trace_job(Target *T, int pid);
+void trace_end(Target *T, int status);
+void trace_suspend();
+void trace_close();
+
+#endif
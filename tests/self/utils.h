@@ -0,0 +1,44 @@
+#ifndef __UTILS_H
+#define __UTILS_H
+#include <llib/str.h>
+str_t join(str_t tname, str_t odir);
+ str_t flag_concat(str_t prefix, str_t* strings) ;
+ str_t* split(str_t s);
+ void cat(str_t *s, str_t extra);
+ bool str_eq2(str_t s1, str_t s2);
+ void *array_pop(void *args);
+ bool str2bool (str_t value) ;
+
+int64_t clock_us();
+
+uint64_t hash_bytes(const void *buf, size_t len, uint64_t seed);
+uint64_t hash_str(str_t s, uint64_t seed);
+bool hash_file(str_t path, uint64_t *digest);
+bool file_write_changed(str_t path, str_t text);
+
+typedef bool (*NameFilter)(str_t path);
+bool dir_digest(str_t dir, NameFilter skip, uint64_t *digest);
+
+typedef struct StrHash_ {
+    str_t *keys;
+    void **values;
+    int size, count;
+} StrHash;
+
+StrHash *strhash_new(int size);
+void *strhash_get(StrHash *h, str_t key);
+void strhash_put(StrHash *h, str_t key, void *value);
+
+typedef struct FileStat_ {
+    str_t path;
+    bool exists, is_dir;
+    int64_t mtime; // nanoseconds; zero if the file does not exist
+    int64_t size;
+    int generation;
+} FileStat;
+
+FileStat *file_stat(str_t path);
+void file_stat_forget(str_t path);
+void file_stat_forget_all();
+void file_stat_counts(int *lookups, int *calls);
+ #endif
@@ -0,0 +1,26 @@
+#ifndef __WORKER_H
+#define __WORKER_H
+#include "jobs.h"
+
+#define WORKER_PROTOCOL "shmake-worker/1"
+
+// building and reading the messages workers and shmake exchange
+void frame_add(JobText *f, const void *data, int len);
+void frame_add_str(JobText *f, str_t s);
+void frame_add_int(JobText *f, int64_t v);
+void frame_start(JobText *f);
+int frame_complete(JobText *f);
+bool frame_send(int fd, JobText *f);
+
+typedef struct FrameReader_ {
+    const char *p, *end;
+} FrameReader;
+
+void frame_reader(FrameReader *r, JobText *f);
+const char *frame_next(FrameReader *r, int *len);
+str_t frame_str(FrameReader *r);
+int64_t frame_int(FrameReader *r);
+
+int worker_main(str_t socket_path, int processes);
+
+#endif
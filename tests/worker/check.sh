@@ -0,0 +1,38 @@
+. ../check.sh
+
+fresh
+echo 'int main() { return 0; }' > a.c
+mkdir sub
+( cd sub && shmakefile <<'X'
+T all 'echo "worker=[$SHMAKE_WORKER]"'
+X
+)
+shmakefile <<'X'
+C a a.c
+T sub a 'shmake -C sub'
+all sub
+X
+
+shmake --worker "$work/sock" -j 1 > worker.out 2>&1 &
+pid=$!
+n=0
+while [ ! -S sock ] && [ $n -lt 50 ]; do
+    sleep 0.1
+    n=$((n + 1))
+done
+export SHMAKE_WORKER="$work/sock"
+
+# the commands go to the worker, and a shmake run by one of them does its own jobs
+run
+kill $pid
+wait $pid
+expect 'linking a'
+expect_not 'no worker'
+expect 'worker=\[\]'
+
+# with the worker gone, the jobs are run here
+echo '/* changed */' >> a.c
+run
+expect 'no worker'
+expect 'compiling a.o'
+echo "$test: ok"
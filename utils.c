@@ -1,8 +1,15 @@
+#define _DEFAULT_SOURCE
 #include "utils.h"
 #include <llib/file.h>
 #include <llib/template.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
 
 // make a full path, creating dir if needed
 str_t join(str_t odir, str_t tname) {
@@ -10,14 +17,22 @@ str_t join(str_t odir, str_t tname) {
         if (*odir == '/') { // absolute
             tname = file_basename(tname);
         }
-        if (! file_exists(odir,"w")) {
+        if (! file_stat(odir)->exists) {
             mkdir(odir,0777);
+            file_stat_forget(odir);
         }
         return str_fmt("%s/%s",odir,tname); 
     }
     return tname;
 }
 
+// a monotonic clock in microseconds, for timing things
+int64_t clock_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000LL + ts.tv_nsec/1000;
+}
+
 // append a string to another, if it exists.
  void cat(str_t* s, str_t extra) {
     if (extra && *extra) {
@@ -82,4 +97,236 @@ bool str_eq2(str_t s1, str_t s2) {
 
 bool str2bool (str_t value) {
     return str_eq_any(value,"true","1") > 0;
-}
\ No newline at end of file
+}
+// a fast 64-bit hash (MurmurHash64A). Chain calls by passing the
+// previous result as the seed.
+uint64_t hash_bytes(const void *buf, size_t len, uint64_t seed) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    const unsigned char *p = (const unsigned char*)buf;
+    uint64_t h = seed ^ (len * m);
+    while (len >= 8) {
+        uint64_t k;
+        memcpy(&k,p,8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+        p += 8;
+        len -= 8;
+    }
+    switch (len) {
+    case 7: h ^= (uint64_t)p[6] << 48;
+    case 6: h ^= (uint64_t)p[5] << 40;
+    case 5: h ^= (uint64_t)p[4] << 32;
+    case 4: h ^= (uint64_t)p[3] << 24;
+    case 3: h ^= (uint64_t)p[2] << 16;
+    case 2: h ^= (uint64_t)p[1] << 8;
+    case 1: h ^= (uint64_t)p[0];
+        h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+uint64_t hash_str(str_t s, uint64_t seed) {
+    return hash_bytes(s,strlen(s),seed);
+}
+
+// digest of a file's contents. Returns false if it can't be read.
+bool hash_file(str_t path, uint64_t *digest) {
+    char buff[65536];
+    int fd = open(path,O_RDONLY);
+    if (fd == -1)
+        return false;
+    uint64_t h = 0;
+    ssize_t n;
+    while ((n = read(fd,buff,sizeof(buff))) > 0) {
+        h = hash_bytes(buff,n,h);
+    }
+    close(fd);
+    if (n < 0)
+        return false;
+    *digest = h;
+    return true;
+}
+
+// write a file only if its contents would change. It's written to a temporary
+// file next to it and renamed, so anyone reading it (another shmake) never sees half
+// of it. mkstemp makes a new file, so it can't be made to write through a symlink.
+bool file_write_changed(str_t path, str_t text) {
+    str_t old = file_read_all(path,false);
+    bool same = old && str_eq(old,text);
+    unref(old);
+    if (same)
+        return true;
+    char *tmp = (char*)str_fmt("%s.XXXXXX",path);
+    int fd = mkstemp(tmp);
+    FILE *out = fd == -1 ? NULL : fdopen(fd,"w");
+    bool ok = out != NULL;
+    if (ok) {
+        // mkstemp only lets us read it, but it should be like any other file we make
+        mode_t mask = umask(0);
+        umask(mask);
+        ok = fchmod(fd,0666 & ~mask) == 0 && fputs(text,out) >= 0;
+    } else
+    if (fd != -1) {
+        close(fd);
+    }
+    if (out && fclose(out) != 0)
+        ok = false;
+    if (ok && rename(tmp,path) != 0)
+        ok = false;
+    if (! ok) {
+        perror(path);
+        if (fd != -1)
+            unlink(tmp);
+    }
+    unref(tmp);
+    file_stat_forget(path);
+    return ok;
+}
+
+// a digest of the names in a directory, not including any that `skip` rejects.
+// The order of the names does not matter.
+bool dir_digest(str_t dir, NameFilter skip, uint64_t *digest) {
+    DIR *d = opendir(dir);
+    if (! d)
+        return false;
+    uint64_t h = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        str_t name = e->d_name;
+        if (str_eq(name,".") || str_eq(name,".."))
+            continue;
+        str_t path = str_eq(dir,".") ? str_new(name) : str_fmt("%s/%s",dir,name);
+        if (! skip || ! skip(path)) {
+            h += hash_str(name,0);
+        }
+        unref(path);
+    }
+    closedir(d);
+    *digest = h;
+    return true;
+}
+
+// A simple hash table with string keys, using open addressing.
+// The keys are not copied, so they must live as long as the table.
+static void StrHash_dispose(StrHash *h) {
+    unref(h->keys);
+    unref(h->values);
+}
+
+static void strhash_alloc(StrHash *h, int size) {
+    h->size = size;
+    h->count = 0;
+    h->keys = array_new(str_t,size);
+    h->values = array_new(void*,size);
+    memset(h->keys,0,size*sizeof(str_t));
+}
+
+StrHash *strhash_new(int size) {
+    StrHash *h = obj_new(StrHash,StrHash_dispose);
+    int sz = 16;
+    while (sz < 2*size)
+        sz *= 2;
+    strhash_alloc(h,sz);
+    return h;
+}
+
+static int strhash_slot(StrHash *h, str_t key) {
+    int mask = h->size - 1;
+    int i = hash_str(key,0) & mask;
+    while (h->keys[i] && ! str_eq(h->keys[i],key)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+void *strhash_get(StrHash *h, str_t key) {
+    int i = strhash_slot(h,key);
+    return h->keys[i] ? h->values[i] : NULL;
+}
+
+void strhash_put(StrHash *h, str_t key, void *value) {
+    int i = strhash_slot(h,key);
+    if (! h->keys[i]) {
+        if (2*(h->count + 1) > h->size) { // keep the table at most half full
+            str_t *keys = h->keys;
+            void **values = h->values;
+            int size = h->size;
+            strhash_alloc(h,2*size);
+            FOR(k,size) {
+                if (keys[k]) {
+                    strhash_put(h,keys[k],values[k]);
+                }
+            }
+            dispose(keys,values);
+            i = strhash_slot(h,key);
+        }
+        h->keys[i] = key;
+        ++h->count;
+    }
+    h->values[i] = value;
+}
+
+// Files are only stat'ed once per run; the results are kept in a hash table
+// keyed on the path. When a file is rebuilt, it must be forgotten.
+static StrHash *s_stats;
+static int s_generation = 1;
+static int s_stat_calls, s_stat_lookups;
+
+FileStat *file_stat(str_t path) {
+    if (! s_stats) {
+        s_stats = strhash_new(1024);
+    }
+    ++s_stat_lookups;
+    FileStat *st = (FileStat*)strhash_get(s_stats,path);
+    if (st && st->generation == s_generation) {
+        return st;
+    }
+    if (! st) {
+        st = obj_new(FileStat,NULL);
+        st->path = str_new(path);
+        strhash_put(s_stats,st->path,st);
+    }
+    struct stat buf;
+    ++s_stat_calls;
+    if (stat(path,&buf) == 0) {
+        st->exists = true;
+        st->is_dir = S_ISDIR(buf.st_mode);
+        st->mtime = buf.st_mtim.tv_sec*1000000000LL + buf.st_mtim.tv_nsec;
+        st->size = buf.st_size;
+    } else {
+        if (errno != ENOENT) {
+            fprintf(stderr,"file %s ",path);
+            perror("stat");
+        }
+        st->exists = st->is_dir = false;
+        st->mtime = st->size = 0;
+    }
+    st->generation = s_generation;
+    return st;
+}
+
+void file_stat_forget(str_t path) {
+    if (! s_stats)
+        return;
+    FileStat *st = (FileStat*)strhash_get(s_stats,path);
+    if (st) {
+        st->generation = 0;
+    }
+}
+
+// a command may have changed anything...
+void file_stat_forget_all() {
+    ++s_generation;
+}
+
+void file_stat_counts(int *lookups, int *calls) {
+    *lookups = s_stat_lookups;
+    *calls = s_stat_calls;
+}
@@ -0,0 +1,203 @@
+/*
+* shmake - a shell-based build tool
+* Copyright (c) 2015, Steve Donovan
+* BSD licence
+*/
+
+// Watching files for changes, for 'shmake -w'. On Linux inotify tells us about
+// the directories holding the files, since editors often write a new file and
+// rename it over the old one; otherwise we look at the files' times every second.
+// A burst of changes (saving several files, a 'git checkout') comes back as one list.
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "watch.h"
+
+// changes are collected until nothing has happened for this long (milliseconds)
+#define SETTLE_TIME 100
+#define POLL_TIME 1000
+
+// the watched paths, keyed by their name as 'dir/file' (or just 'file' if in '.')
+static StrHash *s_files;
+static str_t *s_paths;
+static int64_t *s_times;
+static volatile sig_atomic_t s_interrupted;
+
+#ifdef __linux__
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+static int s_fd = -1;
+static StrHash *s_dirs;
+static str_t **s_wd_dirs; // directory for each watch descriptor
+#endif
+
+static void on_interrupt(int sig) {
+    s_interrupted = 1;
+}
+
+// Ctrl-C stops watching, but lets a build in progress finish (or fail) first.
+bool watch_open() {
+    struct sigaction sa;
+    memset(&sa,0,sizeof(sa));
+    sa.sa_handler = on_interrupt;
+    sigaction(SIGINT,&sa,NULL);
+    sigaction(SIGTERM,&sa,NULL);
+#ifdef __linux__
+    s_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (s_fd == -1) {
+        perror("shmake: inotify");
+    }
+    s_dirs = strhash_new(64);
+    s_wd_dirs = seq_new_ref(str_t);
+#endif
+    return true;
+}
+
+bool watch_interrupted() {
+    return s_interrupted;
+}
+
+static str_t dir_of(str_t path) {
+    char *slash = strrchr(path,'/');
+    if (! slash)
+        return str_new(".");
+    if (slash == path)
+        return str_new("/");
+    char *dir = str_new_size(slash - path);
+    strncpy(dir,path,slash - path);
+    return dir;
+}
+
+static str_t dir_join(str_t dir, str_t name) {
+    if (str_eq(dir,"."))
+        return str_new(name);
+    return str_fmt("%s%s%s",dir,str_ends_with(dir,"/") ? "" : "/",name);
+}
+
+#ifdef __linux__
+static void watch_dir(str_t dir) {
+    if (s_fd == -1 || strhash_get(s_dirs,dir))
+        return;
+    int wd = inotify_add_watch(s_fd,dir,WATCH_EVENTS);
+    if (wd == -1) {
+        perror(dir);
+        return;
+    }
+    dir = str_new(dir);
+    strhash_put(s_dirs,dir,(void*)dir);
+    while (array_len(*s_wd_dirs) <= wd) {
+        seq_add(s_wd_dirs,NULL);
+    }
+    (*s_wd_dirs)[wd] = ref(dir);
+}
+#endif
+
+// from now on, these are the files we want to hear about.
+void watch_files(str_t *paths) {
+    dispose(s_files,s_paths,s_times);
+    s_paths = ref(paths);
+    s_files = strhash_new(2*array_len(paths));
+    s_times = array_new(int64_t,array_len(paths));
+    FOR(i,array_len(paths)) {
+        str_t dir = dir_of(paths[i]);
+        str_t key = dir_join(dir,paths[i] + (str_eq(dir,".") ? 0 : strlen(dir) + 1));
+        strhash_put(s_files,key,(void*)paths[i]);
+        s_times[i] = file_stat(paths[i])->mtime;
+#ifdef __linux__
+        watch_dir(dir);
+#endif
+        unref(dir);
+    }
+}
+
+static void changed_add(StrHash *seen, str_t **changed, str_t path) {
+    if (! strhash_get(seen,path)) {
+        strhash_put(seen,path,(void*)path);
+        seq_add(changed,ref(path));
+    }
+}
+
+#ifdef __linux__
+// read what inotify has for us; returns false if there was nothing
+static bool read_events(NameFilter ignore, StrHash *seen, str_t **changed, bool *new_files) {
+    char buff[16384] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = read(s_fd,buff,sizeof(buff));
+    if (len <= 0)
+        return false;
+    for (char *p = buff; p < buff + len; ) {
+        struct inotify_event *ev = (struct inotify_event*)p;
+        p += sizeof(struct inotify_event) + ev->len;
+        if (ev->len == 0 || ev->wd >= array_len(*s_wd_dirs) || ! (*s_wd_dirs)[ev->wd])
+            continue;
+        str_t path = dir_join((*s_wd_dirs)[ev->wd],ev->name);
+        str_t file = (str_t)strhash_get(s_files,path);
+        if (file) {
+            changed_add(seen,changed,file);
+        } else
+        if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+            if (! ignore || ! ignore(path)) {
+                *new_files = true;
+            }
+        }
+        unref(path);
+    }
+    return true;
+}
+#endif
+
+// wait until some of the watched files change, returning their names. If files
+// which we don't know about appear or vanish (as judged by 'ignore'), then
+// 'new_files' is set. Returns NULL if we were interrupted.
+str_t *watch_wait(NameFilter ignore, bool *new_files) {
+    StrHash *seen = strhash_new(16);
+    str_t **changed = seq_new_ref(str_t);
+    *new_files = false;
+    int timeout = -1;
+    while (! s_interrupted) {
+#ifdef __linux__
+        if (s_fd != -1) {
+            struct pollfd pfd = {s_fd, POLLIN, 0};
+            int n = poll(&pfd,1,timeout);
+            if (n > 0 && read_events(ignore,seen,changed,new_files)) {
+                if (array_len(*changed) > 0 || *new_files) {
+                    timeout = SETTLE_TIME;
+                }
+            } else
+            if (n == 0) { // it has all settled down
+                break;
+            } else
+            if (n < 0 && errno != EINTR) {
+                perror("shmake: poll");
+                break;
+            }
+            continue;
+        }
+#endif
+        poll(NULL,0,POLL_TIME);
+        file_stat_forget_all();
+        FOR(i,array_len(s_paths)) {
+            int64_t t = file_stat(s_paths[i])->mtime;
+            if (t != s_times[i]) {
+                s_times[i] = t;
+                changed_add(seen,changed,s_paths[i]);
+            }
+        }
+        if (array_len(*changed) > 0)
+            break;
+    }
+    unref(seen);
+    str_t *res = seq_array_ref(changed);
+    if (s_interrupted) {
+        unref(res);
+        return NULL;
+    }
+    return res;
+}
@@ -0,0 +1,10 @@
+#ifndef __WATCH_H
+#define __WATCH_H
+#include "utils.h"
+
+bool watch_open();
+void watch_files(str_t *paths);
+str_t *watch_wait(NameFilter ignore, bool *new_files);
+bool watch_interrupted();
+
+#endif
@@ -0,0 +1,350 @@
+/*
+* shmake - a shell-based build tool
+* Copyright (c) 2015, Steve Donovan
+* BSD licence
+*/
+
+// 'shmake --worker SOCKET' runs commands for other shmakes, which find it through
+// $SHMAKE_WORKER. It listens on a Unix socket, with a pool of worker processes
+// forked in advance (one per processor, or -j N), so the build itself does not pay
+// for starting them. Each command comes on a connection of its own, and a worker
+// process serves one connection and then takes the next, so it is never held by
+// a shmake which has nothing for it to do.
+//
+// Messages are _frames_: a 4-byte length and then fields, each a 4-byte length
+// and its bytes (lengths are big-endian). A request is
+//   WORKER_PROTOCOL, cwd, command, N, N environment strings, M, M (path, digest) inputs
+// and its reply is
+//   "done", status, user, sys, maxrss, nvcsw, nivcsw, oom, stdout, stderr.
+// The inputs are the files the command reads, with the digests shmake has for them;
+// a worker checks it sees the same files before running the command.
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <llib/array.h>
+
+#include "worker.h"
+#include "utils.h"
+
+static void buf_add(JobText *f, const void *data, int len) {
+    if (f->len + len + 1 > f->cap) {
+        f->cap = 2*(f->len + len + 1);
+        f->data = realloc(f->data,f->cap);
+    }
+    memcpy(f->data + f->len,data,len);
+    f->len += len;
+    f->data[f->len] = '\0';
+}
+
+static void put_u32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// a new frame, with room for its length
+void frame_start(JobText *f) {
+    f->len = 0;
+    buf_add(f,"\0\0\0\0",4);
+}
+
+void frame_add(JobText *f, const void *data, int len) {
+    unsigned char n[4];
+    put_u32(n,len);
+    buf_add(f,n,4);
+    buf_add(f,data,len);
+}
+
+void frame_add_str(JobText *f, str_t s) {
+    frame_add(f,s,strlen(s));
+}
+
+void frame_add_int(JobText *f, int64_t v) {
+    char buff[32];
+    snprintf(buff,sizeof(buff),"%lld",(long long)v);
+    frame_add_str(f,buff);
+}
+
+// the size of the frame at the start of f, if it has all arrived; otherwise zero
+int frame_complete(JobText *f) {
+    if (f->len < 4)
+        return 0;
+    int len = 4 + get_u32((unsigned char*)f->data);
+    return f->len >= len ? len : 0;
+}
+
+// send the frame, waiting until it has all gone. A reader which has gone away
+// is an error, not a SIGPIPE.
+bool frame_send(int fd, JobText *f) {
+    put_u32((unsigned char*)f->data,f->len - 4);
+    int sent = 0;
+    while (sent < f->len) {
+        ssize_t n = send(fd,f->data + sent,f->len - sent,MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+void frame_reader(FrameReader *r, JobText *f) {
+    r->p = f->data + 4;
+    r->end = f->data + frame_complete(f);
+}
+
+// the next field, or NULL if there are no more
+const char *frame_next(FrameReader *r, int *len) {
+    if (r->end - r->p < 4)
+        return NULL;
+    *len = get_u32((const unsigned char*)r->p);
+    if (r->end - r->p - 4 < *len)
+        return NULL;
+    const char *data = r->p + 4;
+    r->p = data + *len;
+    return data;
+}
+
+str_t frame_str(FrameReader *r) {
+    int len;
+    const char *data = frame_next(r,&len);
+    if (! data)
+        return NULL;
+    char *s = str_new_size(len);
+    memcpy(s,data,len);
+    s[len] = '\0';
+    return s;
+}
+
+int64_t frame_int(FrameReader *r) {
+    str_t s = frame_str(r);
+    int64_t v = s ? strtoll(s,NULL,10) : 0;
+    unref(s);
+    return v;
+}
+
+//////// The worker ////////
+
+extern char **environ;
+
+typedef struct Seen_ {
+    str_t path;
+    int64_t mtime, size;
+    uint64_t digest;
+} Seen;
+
+// the digests of the files we have read, which are only read again if they change
+static StrHash *s_seen;
+
+static bool input_matches(str_t path, uint64_t digest) {
+    struct stat st;
+    if (stat(path,&st) != 0)
+        return false;
+    int64_t mtime = st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec;
+    Seen *s = (Seen*)strhash_get(s_seen,path);
+    if (! s) {
+        s = calloc(1,sizeof(Seen));
+        s->path = str_new(path);
+        s->mtime = -1;
+        strhash_put(s_seen,s->path,s);
+    }
+    if (s->mtime != mtime || s->size != st.st_size) {
+        if (! hash_file(path,&s->digest))
+            return false;
+        s->mtime = mtime;
+        s->size = st.st_size;
+    }
+    return s->digest == digest;
+}
+
+// read one frame, waiting for it; false if the connection has closed
+static bool frame_read(int fd, JobText *f) {
+    char buff[16384];
+    f->len = 0;
+    while (! frame_complete(f)) {
+        ssize_t n = read(fd,buff,sizeof(buff));
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf_add(f,buff,n);
+    }
+    return true;
+}
+
+// run the request's command, returning its reply
+static void run_request(FrameReader *r, JobText *reply) {
+    str_t cwd = frame_str(r), cmd = frame_str(r);
+    int nenv = frame_int(r);
+    char **env = array_new_ref(char*,nenv + 1);
+    FOR(i,nenv) {
+        env[i] = (char*)frame_str(r);
+    }
+    env[nenv] = NULL;
+    str_t error = NULL;
+    if (! cwd || ! cmd || chdir(cwd) != 0) {
+        error = str_fmt("shmake-worker: cannot change to directory %s\n",cwd ? cwd : "?");
+    }
+    int ninputs = frame_int(r);
+    FOR(i,ninputs) {
+        str_t path = frame_str(r);
+        uint64_t digest = (uint64_t)frame_int(r);
+        if (! error && ! input_matches(path,digest)) {
+            error = str_fmt("shmake-worker: %s/%s is not the file shmake has\n",cwd,path);
+        }
+        unref(path);
+    }
+    int status = -1;
+    JobUsage usage;
+    JobText output[2];
+    memset(&usage,0,sizeof(usage));
+    if (! error) {
+        char **saved = environ;
+        environ = env;
+        if (job_start(cmd,env,0,NULL)) {
+            job_wait(&status,&usage,output,false);
+        } else {
+            error = str_fmt("shmake-worker: cannot run %s\n",cmd);
+        }
+        environ = saved;
+    }
+    frame_start(reply);
+    frame_add_str(reply,"done");
+    frame_add_int(reply,status);
+    frame_add_int(reply,usage.user);
+    frame_add_int(reply,usage.sys);
+    frame_add_int(reply,usage.maxrss);
+    frame_add_int(reply,usage.nvcsw);
+    frame_add_int(reply,usage.nivcsw);
+    frame_add_int(reply,usage.oom);
+    if (error) {
+        frame_add_str(reply,"");
+        frame_add_str(reply,error);
+    } else {
+        FOR(k,2) {
+            frame_add(reply,output[k].data,output[k].len);
+        }
+    }
+    dispose(cwd,cmd,env);
+    unref(error);
+}
+
+// run the one command a connection brings, and send back its reply
+static void serve(int conn) {
+    JobText req = {0}, reply = {0};
+    if (frame_read(conn,&req)) {
+        FrameReader r;
+        frame_reader(&r,&req);
+        str_t proto = frame_str(&r);
+        bool ok = proto && str_eq(proto,WORKER_PROTOCOL);
+        unref(proto);
+        if (ok) {
+            run_request(&r,&reply);
+            frame_send(conn,&reply);
+        } else {
+            fprintf(stderr,"shmake-worker: expecting %s\n",WORKER_PROTOCOL);
+        }
+    }
+    close(conn);
+    free(req.data);
+    free(reply.data);
+}
+
+static str_t s_socket;
+static pid_t *s_workers;
+static int s_nworkers;
+
+static void workers_stop(int sig) {
+    FOR(i,s_nworkers) {
+        if (s_workers[i] > 0)
+            kill(s_workers[i],SIGTERM);
+    }
+    unlink(s_socket);
+    _exit(0);
+}
+
+static pid_t worker_fork(int fd) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+    } else
+    if (pid == 0) {
+        signal(SIGTERM,SIG_DFL);
+        signal(SIGINT,SIG_DFL);
+        jobs_set_max(1);
+        s_seen = strhash_new(1024);
+        for (;;) {
+            int conn = accept(fd,NULL,NULL);
+            if (conn == -1) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                perror("accept");
+                _exit(1);
+            }
+            fcntl(conn,F_SETFD,FD_CLOEXEC);
+            serve(conn);
+        }
+    }
+    return pid;
+}
+
+int worker_main(str_t socket_path, int processes) {
+    struct sockaddr_un addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr,"shmake: socket path too long: %s\n",socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path,socket_path);
+    int fd = socket(AF_UNIX,SOCK_STREAM,0);
+    unlink(socket_path);
+    if (fd == -1 || bind(fd,(struct sockaddr*)&addr,sizeof(addr)) != 0 || listen(fd,64) != 0) {
+        perror(socket_path);
+        return 1;
+    }
+    fcntl(fd,F_SETFD,FD_CLOEXEC);
+    s_socket = socket_path;
+    s_nworkers = processes;
+    s_workers = calloc(processes,sizeof(pid_t));
+    signal(SIGTERM,workers_stop);
+    signal(SIGINT,workers_stop);
+    FOR(i,processes) {
+        s_workers[i] = worker_fork(fd);
+    }
+    printf("shmake: %d workers listening on %s\n",processes,socket_path);
+    fflush(stdout);
+    // keep the pool full
+    for (;;) {
+        pid_t pid = wait(NULL);
+        if (pid == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        FOR(i,processes) {
+            if (s_workers[i] == pid) {
+                s_workers[i] = worker_fork(fd);
+            }
+        }
+    }
+    unlink(socket_path);
+    return 0;
+}